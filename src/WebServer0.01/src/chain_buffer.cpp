@@ -0,0 +1,302 @@
+#include "chain_buffer.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <new>
+#include <string.h>
+#include <sys/uio.h>
+
+// 线程本地空闲块缓存，线程退出时归还全局空闲链表
+struct buffer_pool::local_cache {
+	buffer_chunk* head;
+	int count;
+
+	~local_cache() {
+		if (count > 0)
+			buffer_pool::instance().flush(this, count);
+	}
+};
+
+buffer_pool& buffer_pool::instance() {
+	static buffer_pool pool;
+	return pool;
+}
+
+buffer_pool::~buffer_pool() {
+	for (size_t i = 0; i < m_slabs.size(); i++)
+		::operator delete(m_slabs[i]);
+}
+
+buffer_pool::local_cache* buffer_pool::local() {
+	static thread_local local_cache cache = {NULL, 0};
+	return &cache;
+}
+
+buffer_chunk* buffer_pool::alloc() {
+	local_cache* cache = local();
+
+	if (!cache->head)
+		refill(cache);
+
+	buffer_chunk* chunk = cache->head;
+	cache->head = chunk->next;
+	cache->count--;
+
+	chunk->next = NULL;
+	chunk->start = 0;
+	chunk->end = 0;
+	return chunk;
+}
+
+buffer_chunk* buffer_pool::alloc(size_t capacity) {
+	if (capacity <= chunk_capacity())
+		return alloc();
+
+	buffer_chunk* chunk = (buffer_chunk*)::operator new(
+	    offsetof(buffer_chunk, data) + capacity);
+	chunk->next = NULL;
+	chunk->start = 0;
+	chunk->end = 0;
+	chunk->capacity = capacity;
+	chunk->pooled = false;
+	return chunk;
+}
+
+void buffer_pool::release(buffer_chunk* chunk) {
+	if (!chunk->pooled) {
+		::operator delete(chunk);
+		return;
+	}
+
+	local_cache* cache = local();
+	chunk->next = cache->head;
+	cache->head = chunk;
+
+	// 本地缓存溢出时归还一半，避免块在线程间单向流动时无限堆积
+	if (++cache->count > LOCAL_CACHE_CHUNKS)
+		flush(cache, LOCAL_CACHE_CHUNKS / 2);
+}
+
+bool buffer_pool::set_chunk_size(size_t bytes) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// 已有内存块按原大小切分，不能再改变
+	if (!m_slabs.empty() || bytes < MIN_CHUNK_SIZE || bytes > MAX_CHUNK_SIZE)
+		return false;
+
+	m_chunk_size = (bytes + 63) & ~(size_t)63;
+	return true;
+}
+
+size_t buffer_pool::get_slab_count() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_slabs.size();
+}
+
+// 从全局空闲链表取一批块到本地缓存，全局链表为空时申请新的 slab
+void buffer_pool::refill(local_cache* cache) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (!m_free) {
+		char* slab = (char*)::operator new(m_chunk_size * SLAB_CHUNKS);
+		m_slabs.push_back(slab);
+
+		for (int i = 0; i < SLAB_CHUNKS; i++) {
+			buffer_chunk* chunk = (buffer_chunk*)(slab + i * m_chunk_size);
+			chunk->capacity = chunk_capacity();
+			chunk->pooled = true;
+			chunk->next = m_free;
+			m_free = chunk;
+		}
+		m_free_count += SLAB_CHUNKS;
+	}
+
+	for (int i = 0; i < LOCAL_CACHE_CHUNKS / 2 && m_free; i++) {
+		buffer_chunk* chunk = m_free;
+		m_free = chunk->next;
+		m_free_count--;
+
+		chunk->next = cache->head;
+		cache->head = chunk;
+		cache->count++;
+	}
+}
+
+// 将本地缓存头部的 count 个块归还全局空闲链表
+void buffer_pool::flush(local_cache* cache, int count) {
+	buffer_chunk* first = cache->head;
+	buffer_chunk* last = first;
+
+	for (int i = 1; i < count; i++)
+		last = last->next;
+
+	cache->head = last->next;
+	cache->count -= count;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	last->next = m_free;
+	m_free = first;
+	m_free_count += count;
+}
+
+void chain_buffer::init() {
+	m_head = NULL;
+	m_tail = NULL;
+	m_size = 0;
+}
+
+void chain_buffer::clear() {
+	while (m_head) {
+		buffer_chunk* chunk = m_head;
+		m_head = chunk->next;
+		buffer_pool::instance().release(chunk);
+	}
+
+	init();
+}
+
+void chain_buffer::push_back(buffer_chunk* chunk) {
+	if (m_tail)
+		m_tail->next = chunk;
+	else
+		m_head = chunk;
+
+	m_tail = chunk;
+}
+
+const char* chain_buffer::segment(size_t off, size_t* len) const {
+	for (buffer_chunk* c = m_head; c; c = c->next) {
+		size_t n = c->end - c->start;
+
+		if (off < n) {
+			*len = n - off;
+			return c->data + c->start + off;
+		}
+
+		off -= n;
+	}
+
+	*len = 0;
+	return NULL;
+}
+
+void chain_buffer::drain(size_t len) {
+	while (len > 0 && m_head) {
+		size_t n = m_head->end - m_head->start;
+
+		if (len < n) {
+			m_head->start += len;
+			m_size -= len;
+			return;
+		}
+
+		// 块中数据已全部取走，归还内存池
+		len -= n;
+		m_size -= n;
+
+		buffer_chunk* chunk = m_head;
+		m_head = chunk->next;
+		if (!m_head)
+			m_tail = NULL;
+
+		buffer_pool::instance().release(chunk);
+	}
+}
+
+char* chain_buffer::pullup(size_t len) {
+	if (len > m_size)
+		return NULL;
+
+	if (peek_size() >= len)
+		return peek();
+
+	buffer_chunk* chunk = buffer_pool::instance().alloc(len);
+
+	size_t copied = 0;
+	for (buffer_chunk* c = m_head; copied < len; c = c->next) {
+		size_t n = c->end - c->start;
+		if (n > len - copied)
+			n = len - copied;
+
+		memcpy(chunk->data + copied, c->data + c->start, n);
+		copied += n;
+	}
+
+	drain(len);
+
+	chunk->end = len;
+	chunk->next = m_head;
+	m_head = chunk;
+	if (!m_tail)
+		m_tail = chunk;
+	m_size += len;
+
+	return peek();
+}
+
+char* chain_buffer::reserve(size_t len) {
+	if (m_tail && writable() >= len)
+		return write_ptr();
+
+	push_back(buffer_pool::instance().alloc(len));
+	return write_ptr();
+}
+
+void chain_buffer::commit(size_t len) {
+	m_tail->end += len;
+	m_size += len;
+}
+
+void chain_buffer::append(const char* data, size_t len) {
+	while (len > 0) {
+		if (writable() == 0)
+			push_back(buffer_pool::instance().alloc());
+
+		size_t n = std::min(len, writable());
+		memcpy(write_ptr(), data, n);
+		commit(n);
+		data += n;
+		len -= n;
+	}
+}
+
+ssize_t chain_buffer::read_fd(int fd) {
+	struct iovec iv[2];
+	int count = 0;
+
+	size_t space = writable();
+	if (space > 0) {
+		iv[count].iov_base = write_ptr();
+		iv[count].iov_len = space;
+		count++;
+	}
+
+	buffer_chunk* extra = buffer_pool::instance().alloc();
+	iv[count].iov_base = extra->data;
+	iv[count].iov_len = extra->capacity;
+	count++;
+
+	ssize_t n = readv(fd, iv, count);
+
+	if (n <= 0) {
+		int saved = errno;
+		buffer_pool::instance().release(extra);
+		errno = saved;
+		return n;
+	}
+
+	// 尾块放得下时新块不再需要
+	if ((size_t)n <= space) {
+		m_tail->end += n;
+		buffer_pool::instance().release(extra);
+	} else {
+		if (space > 0)
+			m_tail->end += space;
+
+		extra->end = n - space;
+		push_back(extra);
+	}
+
+	m_size += n;
+	return n;
+}
@@ -0,0 +1,128 @@
+#ifndef CHAINBUFFER_H
+#define CHAINBUFFER_H
+
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+// 缓冲区内存块
+// 块头与数据区连续分配，[start, end) 为可读数据，[end, capacity) 为可写空间
+struct buffer_chunk {
+	buffer_chunk* next;
+	uint32_t start;
+	uint32_t end;
+	uint32_t capacity; // 数据区容量
+	bool pooled;       // 来自 buffer_pool，否则为合并时单独分配的大块
+	char data[1];
+};
+
+// 固定大小内存块池
+// 以 slab 为单位批量申请内存块，归还的块挂入空闲链表复用，不归还给系统
+// 每个线程持有少量块的本地缓存，只有本地缓存为空或溢出时才访问加锁的全局空闲链表
+class buffer_pool {
+public:
+	static const size_t DEFAULT_CHUNK_SIZE = 4096; // 默认内存块大小，包含块头
+	static const size_t MIN_CHUNK_SIZE = 1024;
+	static const size_t MAX_CHUNK_SIZE = 1024 * 1024;
+	static const int SLAB_CHUNKS = 64;       // 每个 slab 包含的内存块数量
+	static const int LOCAL_CACHE_CHUNKS = 64; // 线程本地缓存的最大块数
+
+public:
+	static buffer_pool& instance();
+
+	// 设置内存块大小，按 64 字节对齐，只能在第一次申请内存块之前调用
+	bool set_chunk_size(size_t bytes);
+	size_t get_chunk_size() const { return m_chunk_size; }
+
+	// 内存块数据区容量
+	size_t chunk_capacity() const {
+		return m_chunk_size - offsetof(buffer_chunk, data);
+	}
+
+	// 申请与归还内存块，可由任意线程调用
+	buffer_chunk* alloc();
+	void release(buffer_chunk* chunk);
+
+	// 申请数据区至少为 capacity 的内存块，不超过 chunk_capacity() 时取自内存池
+	buffer_chunk* alloc(size_t capacity);
+
+	// 已申请的 slab 数量
+	size_t get_slab_count();
+
+private:
+	buffer_pool()
+	    : m_chunk_size(DEFAULT_CHUNK_SIZE), m_free(NULL), m_free_count(0) {}
+	~buffer_pool();
+
+	buffer_pool(const buffer_pool&) = delete;
+	buffer_pool& operator=(const buffer_pool&) = delete;
+
+	struct local_cache;
+	static local_cache* local();
+	void refill(local_cache* cache);
+	void flush(local_cache* cache, int count);
+
+private:
+	size_t m_chunk_size;      // 启动后不再改变
+	std::mutex m_mutex;       // 保护全局空闲链表与 slab 列表
+	buffer_chunk* m_free;     // 全局空闲链表
+	int m_free_count;
+	std::vector<char*> m_slabs;
+};
+
+// 链式缓冲区
+// 由内存池中的固定大小内存块串成链表，数据可以跨越多个块
+// 只在持有数据时占用内存块，块中数据被全部取走后立即归还内存池
+// 没有构造函数，由 init 初始化，大量连接对象未使用时不会触及其内存
+class chain_buffer {
+public:
+	void init();  // 初始化为空缓冲区，不申请内存
+	void clear(); // 丢弃全部数据并归还内存块
+
+	size_t size() const { return m_size; }
+	bool empty() const { return m_size == 0; }
+
+	// 第一个内存块中的连续可读数据
+	char* peek() const { return m_head ? m_head->data + m_head->start : NULL; }
+	size_t peek_size() const { return m_head ? m_head->end - m_head->start : 0; }
+
+	// 偏移 off 处直到所在内存块末尾的连续数据，len 返回其长度
+	// off 不小于 size() 时返回 NULL
+	const char* segment(size_t off, size_t* len) const;
+
+	// 丢弃头部 len 字节，可以跨越多个内存块
+	void drain(size_t len);
+
+	// 使头部 len 字节位于连续内存中并返回其起始位置
+	// 跨越多个内存块时复制到一个新块，原有数据的偏移保持不变
+	char* pullup(size_t len);
+
+	// 返回尾部至少 len 字节的可写空间，不足时追加新块
+	char* reserve(size_t len);
+
+	// 尾部当前可写空间
+	size_t writable() const { return m_tail ? m_tail->capacity - m_tail->end : 0; }
+	char* write_ptr() const { return m_tail ? m_tail->data + m_tail->end : NULL; }
+
+	// 确认写入 reserve 或 write_ptr 返回空间中的 len 字节
+	void commit(size_t len);
+
+	// 复制 len 字节追加到尾部，先填满尾块剩余空间再换新块，数据可以跨越内存块
+	void append(const char* data, size_t len);
+
+	// 从 fd 读取数据追加到尾部，一次 readv 同时填充尾块剩余空间与一个新块
+	// 返回值同 readv
+	ssize_t read_fd(int fd);
+
+private:
+	void push_back(buffer_chunk* chunk);
+
+private:
+	buffer_chunk* m_head;
+	buffer_chunk* m_tail;
+	size_t m_size; // 可读字节数
+};
+
+#endif
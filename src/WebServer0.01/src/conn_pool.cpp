@@ -0,0 +1,37 @@
+#include "conn_pool.h"
+
+conn_pool::~conn_pool() {
+	for (size_t i = 0; i < m_slabs.size(); i++)
+		delete[] m_slabs[i];
+}
+
+http_conn* conn_pool::alloc(uint64_t* handle) {
+	// 空闲对象用完时申请新的 slab，新槽位逆序入栈，使编号小的先被取用
+	if (m_free.empty()) {
+		uint32_t base = m_slabs.size() * SLAB_CONNS;
+		m_slabs.push_back(new http_conn[SLAB_CONNS]);
+		m_gens.resize(base + SLAB_CONNS, 1);
+		m_used.resize(base + SLAB_CONNS, false);
+
+		for (int i = SLAB_CONNS - 1; i >= 0; i--)
+			m_free.push_back(base + i);
+	}
+
+	uint32_t slot = m_free.back();
+	m_free.pop_back();
+	m_used[slot] = true;
+
+	*handle = make_handle(m_gens[slot], slot);
+	return &m_slabs[slot / SLAB_CONNS][slot % SLAB_CONNS];
+}
+
+void conn_pool::release(http_conn* conn) {
+	uint32_t slot = (uint32_t)conn->get_handle();
+
+	// 代数跳过 0，保证有效句柄不为 0
+	if (++m_gens[slot] == 0)
+		m_gens[slot] = 1;
+
+	m_used[slot] = false;
+	m_free.push_back(slot);
+}
@@ -0,0 +1,66 @@
+#ifndef CONNPOOL_H
+#define CONNPOOL_H
+
+#include "http_conn.h"
+
+#include <stdint.h>
+#include <vector>
+
+// 连接对象池
+// 连接对象以 slab 为单位按需分配，空闲对象按 LIFO 复用，刚释放的对象仍在缓存中
+// 每个槽位有一个代数，对象释放时递增
+// 句柄由代数与槽位编号组成，注册到 I/O 后端（epoll_event.data.u64），事件返回时据此找回对象
+// 对象释放后旧句柄的代数不再匹配，迟到的事件按句柄查找得到 NULL 即可丢弃
+// 只由所属 reactor 线程访问
+class conn_pool {
+public:
+	static const int SLAB_CONNS = 256; // 每个 slab 的连接对象数
+
+public:
+	conn_pool() {}
+	~conn_pool();
+
+	conn_pool(const conn_pool&) = delete;
+	conn_pool& operator=(const conn_pool&) = delete;
+
+	// 取一个空闲连接对象，handle 返回其句柄
+	http_conn* alloc(uint64_t* handle);
+
+	// 归还连接对象，此后该对象的旧句柄全部失效
+	void release(http_conn* conn);
+
+	// 已分配的连接对象数
+	size_t size() const { return m_used.size() - m_free.size(); }
+
+	// 依次访问已分配的连接对象，f 中可以归还当前对象
+	template <typename F>
+	void for_each(F f) {
+		for (size_t slot = 0; slot < m_used.size(); slot++) {
+			if (m_used[slot])
+				f(&m_slabs[slot / SLAB_CONNS][slot % SLAB_CONNS]);
+		}
+	}
+
+	// 按句柄查找连接对象，句柄已失效时返回 NULL
+	http_conn* get(uint64_t handle) const {
+		uint32_t slot = (uint32_t)handle;
+
+		if (slot >= m_gens.size() || m_gens[slot] != (uint32_t)(handle >> 32))
+			return NULL;
+
+		return &m_slabs[slot / SLAB_CONNS][slot % SLAB_CONNS];
+	}
+
+private:
+	static uint64_t make_handle(uint32_t gen, uint32_t slot) {
+		return ((uint64_t)gen << 32) | slot;
+	}
+
+private:
+	std::vector<http_conn*> m_slabs;
+	std::vector<uint32_t> m_gens;  // 各槽位的代数，从 1 开始，句柄 0 始终无效
+	std::vector<uint32_t> m_free;  // 空闲槽位栈
+	std::vector<bool> m_used;      // 各槽位是否已分配
+};
+
+#endif
@@ -0,0 +1,547 @@
+#include "file_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+static const size_t COMPRESS_CHUNK = 16384; // 压缩时每次读取源文件的字节数
+
+// 触发缓存失效的 inotify 事件
+// IN_ATTRIB 包含权限与链接数变化，可覆盖被 rename 覆盖和删除的情况
+static const uint32_t NOTIFY_MASK = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                                    IN_DELETE_SELF | IN_MOVE_SELF;
+
+file_cache& file_cache::instance() {
+	static file_cache cache;
+	return cache;
+}
+
+file_cache::file_cache()
+    : m_capacity(DEFAULT_CAPACITY), m_size(0),
+      m_compress_capacity(DEFAULT_COMPRESS_CAPACITY), m_compressed_size(0),
+      m_compress_level(DEFAULT_COMPRESS_LEVEL), m_threadpool(NULL),
+      m_notify_fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)), m_renderer(NULL) {}
+
+file_cache::~file_cache() {
+	for (auto& kv : m_entries) {
+		if (kv.second->refcount == 0)
+			destroy(kv.second);
+	}
+
+	for (auto& kv : m_compressed) {
+		if (kv.second->refcount == 0)
+			destroy(kv.second);
+	}
+
+	if (m_notify_fd >= 0)
+		close(m_notify_fd);
+}
+
+// 原文件以请求路径为键，预压缩文件在路径后附加 '\0' 与编码名，不会与任何路径相同
+// 键值存放在线程私有的字符串中，容量足够后查找不再分配内存
+file_cache::STATUS file_cache::acquire(const char* name, size_t len,
+                                       file_entry** entry,
+                                       const char* encoding) {
+	static thread_local std::string key;
+	key.assign(name, len);
+	if (encoding) {
+		key.push_back('\0');
+		key.append(encoding);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_entries.find(key);
+
+		if (it != m_entries.end()) {
+			file_entry* e = it->second;
+
+			// 受 inotify 监视的缓存项总是新鲜的，否则与当前 stat 比对
+			if (e->wd >= 0 || is_fresh(e)) {
+				e->refcount++;
+				m_lru.splice(m_lru.begin(), m_lru, e->lru_pos);
+				*entry = e;
+				return FILE_OK;
+			}
+
+			invalidate(e);
+		}
+	}
+
+	// 未命中，拼接完整路径后在锁外完成 stat、open 与 mmap
+	std::string path = m_root;
+	path.append(name, len);
+
+	struct stat st;
+	if (stat(path.c_str(), &st) < 0)
+		return FILE_NOT_FOUND;
+
+	if (!(st.st_mode & S_IROTH))
+		return FILE_FORBIDDEN;
+
+	if (S_ISDIR(st.st_mode))
+		return FILE_IS_DIR;
+
+	file_entry* e = load(path.c_str(), st, encoding);
+	if (!e)
+		return FILE_ERROR;
+
+	e->key = key;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// 其他线程已抢先加载同一文件，使用已有缓存项
+	auto it = m_entries.find(key);
+	if (it != m_entries.end()) {
+		destroy(e);
+		e = it->second;
+		e->refcount++;
+		m_lru.splice(m_lru.begin(), m_lru, e->lru_pos);
+		*entry = e;
+		return FILE_OK;
+	}
+
+	e->refcount = 1;
+
+	// 超出整个预算的文件不进入缓存，释放时直接 munmap
+	if (entry_bytes(e) <= m_capacity) {
+		e->cached = true;
+		m_entries[key] = e;
+		watch(e);
+		m_lru.push_front(e);
+		e->lru_pos = m_lru.begin();
+		m_size += entry_bytes(e);
+
+		// 加载与添加监视之间发生的修改不会产生事件，监视生效后再比对一次
+		// 已变化时移出缓存，本次请求仍使用加载到的内容
+		if (e->wd >= 0 && !is_fresh(e))
+			invalidate(e);
+
+		evict();
+	}
+
+	*entry = e;
+	return FILE_OK;
+}
+
+// 压缩在锁外进行，source 由调用者持有引用，压缩期间不会被释放
+// 结果不计入文件缓存的预算，超出压缩预算的结果不进入缓存，释放时直接销毁
+bool file_cache::acquire_compressed(file_entry* source, file_entry** entry,
+                                    bool async) {
+	int level;
+	bool submit = false;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_compressed.find(source->path);
+
+		if (it != m_compressed.end()) {
+			file_entry* e = it->second;
+
+			if (e->source_size == source->st.st_size &&
+			    e->st.st_ino == source->st.st_ino &&
+			    e->st.st_dev == source->st.st_dev &&
+			    e->st.st_mtim.tv_sec == source->st.st_mtim.tv_sec &&
+			    e->st.st_mtim.tv_nsec == source->st.st_mtim.tv_nsec) {
+				m_compressed_lru.splice(m_compressed_lru.begin(),
+				                        m_compressed_lru, e->lru_pos);
+				if (!e->address)
+					return false;
+
+				e->refcount++;
+				*entry = e;
+				return true;
+			}
+
+			invalidate(e);
+		}
+
+		if (m_compress_capacity == 0)
+			return false;
+
+		level = m_compress_level;
+
+		// 已有同一文件的压缩任务时不再提交，任务持有 source 的一次引用
+		if (async && m_threadpool) {
+			submit = m_compressing.insert(source->path).second;
+			if (submit)
+				source->refcount++;
+		}
+	}
+
+	if (async && m_threadpool) {
+		if (submit)
+			m_threadpool->commit(
+			    [this, source, level] { compress_async(source, level); });
+		return false;
+	}
+
+	file_entry* e = compress(source, level);
+	if (!e)
+		return false;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return insert_compressed(source, e, entry);
+}
+
+// 线程池中执行，结果放入缓存后归还任务持有的 source 引用
+void file_cache::compress_async(file_entry* source, int level) {
+	file_entry* e = compress(source, level);
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_compressing.erase(source->path);
+		if (e)
+			insert_compressed(source, e, NULL);
+	}
+
+	release(source);
+}
+
+// 将压缩结果 e 放入缓存，需持有 m_mutex
+// entry 不为 NULL 时由其返回可用的结果并持有一次引用
+bool file_cache::insert_compressed(file_entry* source, file_entry* e,
+                                   file_entry** entry) {
+	// 其他线程已抢先压缩同一文件，使用已有结果
+	auto it = m_compressed.find(source->path);
+	if (it != m_compressed.end() && it->second->source_size == e->source_size &&
+	    it->second->st.st_mtim.tv_sec == e->st.st_mtim.tv_sec &&
+	    it->second->st.st_mtim.tv_nsec == e->st.st_mtim.tv_nsec &&
+	    it->second->st.st_ino == e->st.st_ino) {
+		destroy(e);
+		e = it->second;
+	} else {
+		if (it != m_compressed.end())
+			invalidate(it->second);
+
+		// 没有压缩效果时只缓存一个空结果，记下不再尝试
+		if (e->st.st_size >= source->st.st_size) {
+			free(e->address);
+			e->address = NULL;
+			e->st.st_size = 0;
+		}
+
+		if (entry_bytes(e) <= m_compress_capacity) {
+			e->cached = true;
+			m_compressed[e->path] = e;
+			m_compressed_lru.push_front(e);
+			e->lru_pos = m_compressed_lru.begin();
+			m_compressed_size += entry_bytes(e);
+		}
+	}
+
+	bool ok = e->address != NULL;
+	if (ok && entry) {
+		e->refcount++;
+		*entry = e;
+	} else if (!e->cached)
+		destroy(e);
+
+	// 先取得引用再淘汰，新结果不会在返回前被销毁
+	evict(m_compressed_lru, m_compressed_size, m_compress_capacity);
+	return ok;
+}
+
+void file_cache::release(file_entry* entry) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (--entry->refcount > 0)
+		return;
+
+	if (!entry->cached)
+		destroy(entry);
+	else if (m_size > m_capacity || m_compressed_size > m_compress_capacity)
+		evict();
+}
+
+void file_cache::discard(file_entry* entry) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	invalidate(entry);
+}
+
+void file_cache::set_capacity(size_t bytes) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_capacity = bytes;
+	evict();
+}
+
+void file_cache::set_compression(size_t bytes, int level) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_compress_capacity = bytes;
+	m_compress_level = level;
+	evict();
+}
+
+void file_cache::handle_notify() {
+	if (m_notify_fd < 0)
+		return;
+
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while (true) {
+		ssize_t len = read(m_notify_fd, buf, sizeof(buf));
+
+		// 其他 reactor 可能已读走事件，EAGAIN 直接返回
+		if (len <= 0)
+			break;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (char* p = buf; p < buf + len;) {
+			const struct inotify_event* event = (const struct inotify_event*)p;
+			std::vector<file_entry*> stale;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				// 事件队列溢出，丢失的事件无从得知，所有受监视的缓存项全部失效
+				for (auto it = m_watches.begin(); it != m_watches.end(); ++it)
+					stale.push_back(it->second);
+			} else {
+				// 同一 inode 可能以多个路径被缓存，全部失效
+				auto range = m_watches.equal_range(event->wd);
+				for (auto it = range.first; it != range.second; ++it)
+					stale.push_back(it->second);
+			}
+
+			for (size_t i = 0; i < stale.size(); i++)
+				invalidate(stale[i]);
+
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+}
+
+file_entry* file_cache::load(const char* path, const struct stat& st,
+                             const char* encoding) {
+	char* address = NULL;
+	int fd = -1;
+
+	if (st.st_size > 0) {
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return NULL;
+
+		void* p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (p == MAP_FAILED) {
+			close(fd);
+			return NULL;
+		}
+
+		address = (char*)p;
+	}
+
+	file_entry* e = new file_entry;
+	e->path = path;
+	e->st = st;
+	e->address = address;
+	e->fd = fd;
+	e->refcount = 0;
+	e->cached = false;
+	e->generated = false;
+	e->encoding = encoding;
+	e->source_size = 0;
+	e->precompressed = 0;
+	e->type = NULL;
+	e->wd = -1;
+	e->response.status = 0;
+	e->response.head_len = 0;
+	e->not_modified.status = 0;
+	e->not_modified.head_len = 0;
+
+	if (m_renderer)
+		m_renderer(e);
+
+	return e;
+}
+
+// 以 gzip 格式压缩整个文件，st 除大小外沿用原文件，用于判断结果是否过期
+// 以 pread 分块读取源文件而不读映射：压缩期间文件被截断时读映射会触发 SIGBUS，
+// pread 则读到的字节不足，放弃本次压缩
+file_entry* file_cache::compress(file_entry* source, int level) {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+
+	// windowBits 加 16 输出 gzip 头部与尾部
+	if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) !=
+	    Z_OK)
+		return NULL;
+
+	size_t bound = deflateBound(&zs, source->st.st_size);
+	char* out = (char*)malloc(bound);
+	if (!out) {
+		deflateEnd(&zs);
+		return NULL;
+	}
+
+	zs.next_out = (Bytef*)out;
+	zs.avail_out = bound;
+
+	char chunk[COMPRESS_CHUNK];
+	off_t offset = 0;
+	int ret = Z_OK;
+
+	while (ret == Z_OK) {
+		size_t want = source->st.st_size - offset;
+		if (want > sizeof(chunk))
+			want = sizeof(chunk);
+
+		ssize_t n = want > 0 ? pread(source->fd, chunk, want, offset) : 0;
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 || (size_t)n != want)
+			break;
+
+		offset += n;
+		zs.next_in = (Bytef*)chunk;
+		zs.avail_in = n;
+		ret = deflate(&zs, offset == source->st.st_size ? Z_FINISH : Z_NO_FLUSH);
+	}
+
+	size_t len = zs.total_out;
+	deflateEnd(&zs);
+
+	if (ret != Z_STREAM_END) {
+		free(out);
+		return NULL;
+	}
+
+	// 归还 deflateBound 多预留的空间
+	char* shrunk = (char*)realloc(out, len);
+	if (shrunk)
+		out = shrunk;
+
+	file_entry* e = new file_entry;
+	e->path = source->path;
+	e->st = source->st;
+	e->st.st_size = len;
+	e->address = out;
+	e->fd = -1;
+	e->refcount = 0;
+	e->cached = false;
+	e->generated = true;
+	e->encoding = "gzip";
+	e->source_size = source->st.st_size;
+	e->precompressed = 0;
+	e->type = NULL;
+	e->wd = -1;
+	e->response.status = 0;
+	e->response.head_len = 0;
+	e->not_modified.status = 0;
+	e->not_modified.head_len = 0;
+
+	if (m_renderer && len < (size_t)source->st.st_size)
+		m_renderer(e);
+
+	return e;
+}
+
+// 为进入缓存的文件添加 inotify 监视
+// 同一 inode 的多个路径会得到相同的 wd
+void file_cache::watch(file_entry* entry) {
+	if (m_notify_fd < 0)
+		return;
+
+	entry->wd = inotify_add_watch(m_notify_fd, entry->path.c_str(), NOTIFY_MASK);
+	if (entry->wd >= 0)
+		m_watches.insert(std::make_pair(entry->wd, entry));
+}
+
+// 移除缓存项的 inotify 监视，仅当没有其他缓存项共用该 wd 时移除内核监视
+void file_cache::unwatch(file_entry* entry) {
+	if (entry->wd < 0)
+		return;
+
+	auto range = m_watches.equal_range(entry->wd);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second == entry) {
+			m_watches.erase(it);
+			break;
+		}
+	}
+
+	if (m_watches.count(entry->wd) == 0)
+		inotify_rm_watch(m_notify_fd, entry->wd);
+
+	entry->wd = -1;
+}
+
+// 无 inotify 时的新鲜度检查，inode、大小、修改时间及权限均未变化
+bool file_cache::is_fresh(const file_entry* entry) const {
+	struct stat st;
+	if (stat(entry->path.c_str(), &st) < 0)
+		return false;
+
+	return st.st_ino == entry->st.st_ino && st.st_dev == entry->st.st_dev &&
+	       st.st_size == entry->st.st_size &&
+	       st.st_mode == entry->st.st_mode &&
+	       st.st_mtim.tv_sec == entry->st.st_mtim.tv_sec &&
+	       st.st_mtim.tv_nsec == entry->st.st_mtim.tv_nsec;
+}
+
+// 将缓存项移出缓存，仍被引用时由最后一次 release 释放
+void file_cache::invalidate(file_entry* entry) {
+	if (!entry->cached)
+		return;
+
+	if (entry->generated) {
+		m_compressed.erase(entry->path);
+		m_compressed_lru.erase(entry->lru_pos);
+		m_compressed_size -= entry_bytes(entry);
+	} else {
+		m_entries.erase(entry->key);
+		m_lru.erase(entry->lru_pos);
+		m_size -= entry_bytes(entry);
+		unwatch(entry);
+	}
+
+	entry->cached = false;
+
+	if (entry->refcount == 0)
+		destroy(entry);
+}
+
+void file_cache::evict() {
+	evict(m_lru, m_size, m_capacity);
+	evict(m_compressed_lru, m_compressed_size, m_compress_capacity);
+}
+
+// 从 LRU 表尾开始淘汰未被使用的缓存项，直到满足预算
+// size 随 invalidate 减少
+void file_cache::evict(std::list<file_entry*>& lru, const size_t& size,
+                       size_t capacity) {
+	auto it = lru.end();
+
+	while (size > capacity && it != lru.begin()) {
+		file_entry* e = *--it;
+
+		if (e->refcount == 0) {
+			// 先移到后继节点，invalidate 会删除当前节点
+			++it;
+			invalidate(e);
+		}
+	}
+}
+
+// 缓存项计入预算的字节数，包括生成的应答
+size_t file_cache::entry_bytes(const file_entry* entry) {
+	return entry->st.st_size + entry->response.data.size() +
+	       entry->not_modified.data.size() + entry->etag.size() +
+	       entry->validators.size();
+}
+
+void file_cache::destroy(file_entry* entry) {
+	if (entry->generated)
+		free(entry->address);
+	else if (entry->address)
+		munmap(entry->address, entry->st.st_size);
+
+	if (entry->fd >= 0)
+		close(entry->fd);
+
+	delete entry;
+}
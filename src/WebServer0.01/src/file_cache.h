@@ -0,0 +1,159 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include "../../base/ThreadPool/src/ThreadPool.h"
+
+#include <limits.h>
+#include <list>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <unordered_set>
+
+// 预先生成的完整应答，多个连接共享只读
+// data 的前 head_len 字节为状态行与固定头部，其后为结束头部的空行与消息体
+struct prerendered {
+	int status;
+	std::string data;
+	size_t head_len;
+};
+
+struct mime_type;
+
+// 内容编码，可按位组合
+enum CONTENT_ENCODING { ENCODING_GZIP = 1, ENCODING_BR = 2 };
+
+// 缓存的文件映射
+// 引用计数归零且已失效或被淘汰时才执行 munmap
+// 压缩的表示也是缓存项：预压缩的兄弟文件以编码区分缓存键，
+// 即时压缩的结果保存在堆内存中，st 除大小外与原文件相同
+struct file_entry {
+	std::string key;      // 缓存键值，即时压缩的结果为空
+	std::string path;     // 根目录与请求路径拼接成的文件路径
+	struct stat st;       // 加载时的文件状态
+	char* address;        // mmap 起始地址或压缩结果，空文件为 NULL
+	int fd;               // 保持打开的文件描述符，供 sendfile 使用，空文件与压缩结果为 -1
+	int refcount;         // 正在使用该映射的连接数量
+	int wd;               // inotify 监视描述符，未监视时为 -1
+	bool cached;          // 是否仍在缓存中，失效或淘汰后置为 false
+	bool generated;       // 由 acquire_compressed 生成，address 由 malloc 分配
+	const char* encoding; // 内容编码名，原始文件为 NULL
+	off_t source_size;    // 即时压缩前的文件大小，用于判断结果是否过期
+	int precompressed;    // 加载时探测到的预压缩兄弟文件，CONTENT_ENCODING 位
+	const mime_type* type; // 按原文件名确定的内容类型，由渲染函数设置
+
+	// 以下由渲染函数生成，未生成时为空
+	prerendered response;     // 完整的 200 应答
+	prerendered not_modified; // 304 应答
+	std::string etag;         // 强 ETag，含引号
+	std::string validators;   // ETag 与 Last-Modified 头部行
+	std::list<file_entry*>::iterator lru_pos; // 在 LRU 链表中的位置
+};
+
+// 进程级文件映射缓存
+// 以相对根目录的请求路径为键缓存 stat 与 mmap 结果，命中时不拼接路径，也不再产生任何系统调用
+// 文件变化通过 inotify 通知失效，inotify 不可用或添加监视失败时每次命中重新 stat 比对
+// 缓存总字节数超出预算时按 LRU 淘汰未被使用的映射
+// 即时压缩的结果另有一份预算与 LRU，以原文件路径为键，原文件的 inode、大小或修改时间
+// 变化后视为过期，下次请求时重新压缩
+// reactor 线程中未命中时压缩交给线程池，完成前的请求发送原文件，同一文件同时只有一个压缩任务
+class file_cache {
+public:
+	// 查找结果
+	enum STATUS { FILE_OK = 0, FILE_NOT_FOUND, FILE_FORBIDDEN, FILE_IS_DIR, FILE_ERROR };
+
+	static const size_t DEFAULT_CAPACITY = 64 * 1024 * 1024; // 默认缓存预算 64 MB
+	static const size_t DEFAULT_COMPRESS_CAPACITY = 16 * 1024 * 1024; // 默认压缩结果预算 16 MB
+	static const int DEFAULT_COMPRESS_LEVEL = 6;
+	static const size_t MAX_ROOT_LEN = PATH_MAX / 2; // 根目录需给请求路径留出空间
+
+	// 渲染函数，文件加载后在锁外调用，可为缓存项生成应答与校验值
+	typedef void (*render_func)(file_entry* entry);
+
+public:
+	static file_cache& instance();
+
+	// 获取根目录下 name 的文件映射，name 为已规范化、以 '/' 开头的请求路径
+	// 成功时 entry 持有一次引用，使用完毕需调用 release
+	// encoding 不为 NULL 时 name 为以该编码预压缩的文件，与直接请求该文件的缓存项相互独立
+	STATUS acquire(const char* name, size_t len, file_entry** entry,
+	               const char* encoding = NULL);
+
+	// 获取 source 的 gzip 压缩结果，未命中时在调用线程中压缩
+	// async 为真且设置了线程池时改为提交压缩任务并返回 false，调用者本次使用原文件
+	// 压缩后不比原文件小时记下该结果并返回 false，此后不再尝试
+	bool acquire_compressed(file_entry* source, file_entry** entry,
+	                        bool async = false);
+
+	void release(file_entry* entry);
+
+	// 发现文件内容已与缓存项不一致时将其移出缓存，不必等待 inotify 事件
+	void discard(file_entry* entry);
+
+	// 设置缓存字节预算，超出部分立即淘汰
+	void set_capacity(size_t bytes);
+	size_t get_capacity() const { return m_capacity; }
+
+	// 设置压缩结果的字节预算与压缩级别，为 0 时不再缓存新的压缩结果
+	void set_compression(size_t bytes, int level);
+
+	// 设置渲染函数与根目录，需在 reactor 启动前调用
+	void set_renderer(render_func func) { m_renderer = func; }
+	void set_root(const char* path, size_t len) { m_root.assign(path, len); }
+
+	// 设置异步压缩使用的线程池，需在 reactor 启动前调用
+	void set_thread_pool(TP::UThreadPool* pool) { m_threadpool = pool; }
+
+	// inotify 文件描述符，由各 reactor 注册到 I/O 后端，不可用时返回 -1
+	int get_notify_fd() const { return m_notify_fd; }
+
+	// 读取 inotify 事件并使对应缓存项失效
+	void handle_notify();
+
+private:
+	file_cache();
+	~file_cache();
+
+	file_cache(const file_cache&) = delete;
+	file_cache& operator=(const file_cache&) = delete;
+
+	file_entry* load(const char* path, const struct stat& st,
+	                 const char* encoding);
+	file_entry* compress(file_entry* source, int level);
+	void compress_async(file_entry* source, int level);
+	bool insert_compressed(file_entry* source, file_entry* e, file_entry** entry);
+	void watch(file_entry* entry);
+	void unwatch(file_entry* entry);
+	bool is_fresh(const file_entry* entry) const;
+	void invalidate(file_entry* entry);
+	void evict();
+	void evict(std::list<file_entry*>& lru, const size_t& size, size_t capacity);
+	void destroy(file_entry* entry);
+	static size_t entry_bytes(const file_entry* entry);
+
+private:
+	std::mutex m_mutex;
+	std::unordered_map<std::string, file_entry*> m_entries; // 路径到缓存项
+	std::unordered_multimap<int, file_entry*> m_watches;    // inotify wd 到缓存项
+	std::list<file_entry*> m_lru;                           // 表头为最近使用
+
+	size_t m_capacity; // 缓存字节预算
+	size_t m_size;     // 当前缓存字节数
+
+	std::unordered_map<std::string, file_entry*> m_compressed; // 原文件路径到压缩结果
+	std::list<file_entry*> m_compressed_lru;
+	size_t m_compress_capacity;
+	size_t m_compressed_size;
+	int m_compress_level;
+	std::unordered_set<std::string> m_compressing; // 正在线程池中压缩的原文件路径
+	TP::UThreadPool* m_threadpool;                  // 异步压缩使用的线程池
+
+	int m_notify_fd; // inotify 文件描述符
+
+	std::string m_root; // 根目录，不以 '/' 结尾
+
+	render_func m_renderer;
+};
+
+#endif
@@ -0,0 +1,205 @@
+#include "hot_upgrade.h"
+#include "server_log.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+extern char** environ;
+
+// 新进程由该环境变量得知 Unix 域 socket 的描述符
+static const char* UPGRADE_ENV = "WEBSERVER_UPGRADE_FD";
+
+// 每条消息附带的最大描述符数，内核上限为 SCM_MAX_FD（253）
+static const int FDS_PER_MSG = 64;
+
+static const char READY_BYTE = 'R';
+
+char hot_upgrade::m_exe[4096];
+char** hot_upgrade::m_argv = NULL;
+int hot_upgrade::m_channel = -1;
+
+// 新的可执行文件通常以 rename 覆盖旧文件，此时 /proc/self/exe 会带上 " (deleted)"
+// 因此在启动时解析路径，升级时按该路径执行
+void hot_upgrade::init(char* argv[]) {
+	m_argv = argv;
+
+	ssize_t len = readlink("/proc/self/exe", m_exe, sizeof(m_exe) - 1);
+	if (len < 0)
+		len = snprintf(m_exe, sizeof(m_exe), "%s", argv[0]);
+	m_exe[len] = '\0';
+}
+
+// 每条消息的数据部分为描述符总数，接收方据此判断是否收齐
+static bool send_fds(int channel, const std::vector<int>& fds) {
+	uint32_t total = fds.size();
+	size_t sent = 0;
+
+	do {
+		size_t n = std::min(fds.size() - sent, (size_t)FDS_PER_MSG);
+
+		struct iovec iov = {&total, sizeof(total)};
+		char control[CMSG_SPACE(FDS_PER_MSG * sizeof(int))];
+		memset(control, 0, sizeof(control));
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		if (n > 0) {
+			msg.msg_control = control;
+			msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+
+			struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &fds[sent], n * sizeof(int));
+		}
+
+		if (sendmsg(channel, &msg, MSG_NOSIGNAL) != sizeof(total))
+			return false;
+
+		sent += n;
+	} while (sent < fds.size());
+
+	return true;
+}
+
+static bool recv_fds(int channel, std::vector<int>* fds) {
+	uint32_t total = 0;
+
+	do {
+		struct iovec iov = {&total, sizeof(total)};
+		char control[CMSG_SPACE(FDS_PER_MSG * sizeof(int))];
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		ssize_t ret = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+		if (ret != sizeof(total) || (msg.msg_flags & MSG_CTRUNC))
+			return false;
+
+		for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+
+			size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			const int* p = (const int*)CMSG_DATA(cmsg);
+			fds->insert(fds->end(), p, p + n);
+		}
+	} while (fds->size() < total);
+
+	return true;
+}
+
+// 新进程未能就绪时终止它，由单独的线程回收，不阻塞旧进程
+static void abort_child(pid_t pid) {
+	kill(pid, SIGTERM);
+	std::thread([pid] { waitpid(pid, NULL, 0); }).detach();
+}
+
+bool hot_upgrade::start(const std::vector<int>& listenfds) {
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		logw("upgrade: socketpair failed, errno is: {}", errno);
+		return false;
+	}
+
+	// fork 后子进程只能调用异步信号安全的函数，环境变量提前准备好
+	char channel_env[64];
+	snprintf(channel_env, sizeof(channel_env), "%s=%d", UPGRADE_ENV, sv[1]);
+
+	std::vector<char*> envp;
+	for (char** e = environ; *e; e++)
+		envp.push_back(*e);
+	envp.push_back(channel_env);
+	envp.push_back(NULL);
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		logw("upgrade: fork failed, errno is: {}", errno);
+		close(sv[0]);
+		close(sv[1]);
+		return false;
+	}
+
+	if (pid == 0) {
+		// 只有子进程一端在 exec 后保留
+		fcntl(sv[1], F_SETFD, 0);
+		execve(m_exe, m_argv, envp.data());
+		_exit(127);
+	}
+
+	close(sv[1]);
+	logi("upgrade: started {} as pid {}, passing {} listeners", m_exe, pid,
+	     listenfds.size());
+
+	bool ok = send_fds(sv[0], listenfds);
+
+	if (ok) {
+		struct pollfd pfd = {sv[0], POLLIN, 0};
+		char byte = 0;
+		ok = poll(&pfd, 1, READY_TIMEOUT) == 1 &&
+		     read(sv[0], &byte, 1) == 1 && byte == READY_BYTE;
+	}
+
+	close(sv[0]);
+
+	if (!ok) {
+		logw("upgrade: pid {} did not become ready, keep serving", pid);
+		abort_child(pid);
+		return false;
+	}
+
+	logi("upgrade: pid {} ready, stop accepting", pid);
+	return true;
+}
+
+bool hot_upgrade::inherit(std::vector<int>* listenfds) {
+	const char* env = getenv(UPGRADE_ENV);
+	if (!env)
+		return false;
+
+	m_channel = atoi(env);
+	unsetenv(UPGRADE_ENV);
+
+	fcntl(m_channel, F_SETFD, FD_CLOEXEC);
+
+	if (!recv_fds(m_channel, listenfds)) {
+		logw("upgrade: failed to receive listeners, errno is: {}", errno);
+		close(m_channel);
+		m_channel = -1;
+		return false;
+	}
+
+	logi("upgrade: inherited {} listeners", listenfds->size());
+	return true;
+}
+
+void hot_upgrade::ready() {
+	if (m_channel < 0)
+		return;
+
+	ssize_t ret = write(m_channel, &READY_BYTE, 1);
+	(void)ret;
+
+	close(m_channel);
+	m_channel = -1;
+}
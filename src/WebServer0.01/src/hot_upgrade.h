@@ -0,0 +1,35 @@
+#ifndef HOTUPGRADE_H
+#define HOTUPGRADE_H
+
+#include <vector>
+
+// 平滑升级
+// 旧进程收到 SIGUSR2 后 fork 并 exec 磁盘上的（新）可执行文件，参数不变，
+// 两进程间以 Unix 域 socket 相连，监听 socket 以 SCM_RIGHTS 交给新进程
+// 新进程的 reactor 开始运行后回复一个字节，旧进程此时才停止接受并处理完已有连接
+// 监听 socket 始终至少有一个进程持有，升级期间不会拒绝新连接
+class hot_upgrade {
+public:
+	static const int READY_TIMEOUT = 10000; // 等待新进程就绪的期限，单位毫秒
+
+public:
+	// 启动时记录可执行文件路径与参数，argv 需在进程存续期间有效
+	static void init(char* argv[]);
+
+	// 旧进程：启动新进程并交出监听 socket，新进程就绪后返回 true
+	// 失败时终止新进程，旧进程继续服务
+	static bool start(const std::vector<int>& listenfds);
+
+	// 新进程：取得旧进程交来的监听 socket，不是由升级启动时返回 false
+	static bool inherit(std::vector<int>* listenfds);
+
+	// 新进程：已开始接受连接，通知旧进程退出
+	static void ready();
+
+private:
+	static char m_exe[4096];
+	static char** m_argv;
+	static int m_channel; // 新进程与旧进程间的 Unix 域 socket
+};
+
+#endif
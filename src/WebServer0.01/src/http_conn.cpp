@@ -1,154 +1,294 @@
 #include "http_conn.h"
+#include "http_date.h"
+#include "mime_types.h"
+#include "metrics.h"
+#include "server_log.h"
+
+#include <algorithm>
 
 // HTTP 响应的状态信息
-const char* ok_200_title = "OK";
-const char* error_400_title = "Bad Request";
 const char* error_400_form =
     "Your request has bad syntax or is inherently impossible to satisfy.\n";
-const char* error_403_title = "Forbidden";
 const char* error_403_form =
     "You do not have permission to get file from this server.\n";
-const char* error_404_title = "Not Found";
 const char* error_404_form =
     "The requested file was not found on this server.\n";
-const char* error_500_title = "Internal Error";
+const char* error_405_form =
+    "The request method is not allowed for the requested URL.\n";
+const char* error_413_form =
+    "The request body is larger than the server is willing to process.\n";
+const char* error_416_form =
+    "The requested range is not satisfiable.\n";
+const char* error_417_form =
+    "The expectation given in the Expect header could not be met.\n";
 const char* error_500_form =
     "There was an unusual problem serving the requested file.\n";
+const char* error_501_form =
+    "The server does not support the functionality required.\n";
+const char* error_505_form =
+    "The HTTP version used in the request is not supported.\n";
+const char* continue_form = "HTTP/1.1 100 Continue\r\n\r\n";
+const char* empty_file_form = "<html><body></body></html>";
 
-// 网站的根目录
-const char* doc_root = "/home/lovelydayss/Code/webserver/src/template/html";
-
-// epoll
-int setnonblocking(int fd) {
-	int old_option = fcntl(fd, F_GETFL);
-	int new_option = old_option | O_NONBLOCK;
+// 文件应答声明支持 Range
+static const char accept_ranges[] = "Accept-Ranges: bytes\r\n";
 
-	fcntl(fd, F_SETFL, new_option);
-	return old_option;
-}
 
-void addfd(int epollfd, int fd, bool one_shot) {
-	epoll_event event;
-	event.data.fd = fd;
-	event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+// I/O 后端事件注册
+// fd 需已是非阻塞的，连接由 accept4 或 io_uring accept 以 SOCK_NONBLOCK 创建
+void addfd(io_backend* backend, int fd, uint64_t data, bool one_shot) {
+	uint32_t events = EPOLLIN | EPOLLET | EPOLLRDHUP;
 
 	if (one_shot)
-		event.events |= EPOLLONESHOT;
+		events |= EPOLLONESHOT;
 
-	epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-	setnonblocking(fd);
+	backend->add(fd, events, data);
 }
 
-void removefd(int epollfd, int fd) {
-	epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, 0);
+void removefd(io_backend* backend, int fd) {
+	backend->del(fd);
 	close(fd);
 }
 
-void modfd(int epollfd, int fd, int ev) {
-	epoll_event event;
-	event.data.fd = fd;
-	event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
-	epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
+void modfd(io_backend* backend, int fd, uint64_t data, int ev) {
+	backend->mod(fd, ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP, data);
+}
+
+std::atomic<int> http_conn::m_user_count(0);
+std::atomic<off_t> http_conn::m_sendfile_threshold(
+    http_conn::DEFAULT_SENDFILE_THRESHOLD);
+std::atomic<off_t> http_conn::m_prerender_threshold(
+    http_conn::DEFAULT_PRERENDER_THRESHOLD);
+std::atomic<bool> http_conn::m_precompressed(true);
+std::atomic<off_t> http_conn::m_compress_min_size(
+    http_conn::DEFAULT_COMPRESS_MIN_SIZE);
+std::atomic<off_t> http_conn::m_compress_max_size(
+    http_conn::DEFAULT_COMPRESS_MAX_SIZE);
+int http_conn::m_max_read_size = http_conn::DEFAULT_MAX_READ_SIZE;
+std::atomic<bool> http_conn::m_draining(false);
+prerendered http_conn::m_error_pages[http_conn::CLOSED_CONNECTION + 1];
+std::vector<http_conn::handler> http_conn::m_handlers;
+const http_conn::handler http_conn::m_static_handler = {
+    "/", 1, &http_conn::serve_static, false, 1 << GET, NULL};
+
+// 根目录需给请求的 URL 留出空间，文件缓存以其拼接请求路径
+bool http_conn::set_doc_root(const char* path) {
+	size_t len = strlen(path);
+	if (len == 0 || len >= file_cache::MAX_ROOT_LEN)
+		return false;
+
+	// 去掉末尾的 '/'，URL 总以 '/' 开头
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+
+	file_cache::instance().set_root(path, len);
+	return true;
 }
 
-int http_conn::m_user_count = 0;
-int http_conn::m_epollfd = -1;
+void http_conn::register_handler(const char* prefix, handler_func func,
+                                 bool blocking, unsigned methods,
+                                 body_func on_body) {
+	handler h = {prefix, strlen(prefix), func, blocking, methods, on_body};
+	m_handlers.push_back(h);
+}
 
 void http_conn::close_conn(bool real_close) {
 	if (real_close && (m_sockfd != -1)) {
-		removefd(m_epollfd, m_sockfd);
+		timer_wheel::cancel(&m_timer);
+		m_timer_kind = TIMER_NONE;
+		unmap();
+		m_read_buf.clear();
+		m_head_buf.clear();
+		m_body_buf.clear();
+		m_write_buf.clear();
+		m_log_buf.clear();
+		removefd(m_backend, m_sockfd);
 		m_sockfd = -1;
 		m_user_count--; // 每关闭一个连接，客户数量减一
+		metrics::add(MC_CONN_CLOSED);
+		metrics::add(MG_CONNECTIONS, -1);
 	}
 }
 
-void http_conn::init(int sockfd, const sockaddr_in& addr) {
+void http_conn::init(int sockfd, const sockaddr_in& addr,
+                     io_backend* backend, uint64_t handle) {
+	m_backend = backend;
+	m_handle = handle;
 	m_sockfd = sockfd;
+	m_file = 0;
+	m_file_address = 0;
+	m_file_stat = 0;
+	m_send_file_count = 0;
+	m_busy = 0;
+	m_sending = false;
+	m_send_canceled = false;
+	m_recv_after = false;
+	memset(&m_msg, 0, sizeof(m_msg));
+	timer_wheel::init_node(&m_timer, this);
+	m_timer_kind = TIMER_NONE;
 	m_address = addr;
+	m_accept_tsc = server_log::rdtsc();
 
 	// 此处两行用于避免 TIME_WAIT 实际使用时候应该去掉
 	int reuse = 1;
 	setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
-	addfd(m_epollfd, sockfd, true);
+	// 后端支持时由其收发数据，否则注册就绪事件
+	m_stream = m_backend->add_stream(sockfd, m_handle);
+	if (!m_stream)
+		addfd(m_backend, sockfd, m_handle, true);
 	m_user_count++;
+	metrics::add(MC_CONN_ACCEPTED);
+	metrics::add(MG_CONNECTIONS, 1);
 
 	init();
 }
 
 void http_conn::init() {
+	m_read_buf.init();
+	m_head_buf.init();
+	m_body_buf.init();
+	m_write_buf.init();
+	m_log_buf.init();
+	m_checked_idx = 0;
+	m_pipelined = false;
+	m_on_reactor = false;
+	m_last_read_tsc = 0;
+
+	init_request();
+	init_response();
+
+}
+
+// 丢弃已处理的请求，剩余的流水线数据成为下一个请求的起点
+// 已处理完的内存块随即归还内存池
+void http_conn::init_request() {
+	m_read_buf.drain(m_checked_idx);
+	m_head_buf.clear();
+	m_body_buf.clear();
+	update_read_view();
+
+	m_checked_idx = 0;
+	m_start_line = 0;
+	m_scan_cr = false;
+	m_line_count = 0;
+	m_body_need = 0;
+	m_body_received = 0;
+	m_trailer_count = 0;
+
 	m_check_state = CHECK_STATE_REQUESTLINE;
 	m_linger = false;
+	m_conn_close = false;
+	m_conn_keep_alive = false;
 
 	m_method = GET;
-	m_url = 0;
-	m_version = 0;
+	m_version = 1;
+	m_url.off = m_url.len = 0;
+	m_query.off = m_query.len = 0;
+	m_host.off = m_host.len = 0;
+	m_header_count = 0;
+	m_range_count = 0;
 	m_content_length = 0;
-	m_host = 0;
-	m_start_line = 0;
-	m_checked_idx = 0;
-	m_read_idx = 0;
-	m_write_idx = 0;
-
-	memset(m_read_buf, '\0', READ_BUFFER_SIZE);
-	memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
-	memset(m_real_file, '\0', FILENAME_LEN);
-}
-
-// 从状态机，用于解析一行内容
-http_conn::LINE_STATUS http_conn::parse_line() {
-
-	char text;
-
-	for (; m_checked_idx < m_read_idx; ++m_checked_idx) {
-		// 当前分析字节
-		text = m_read_buf[m_checked_idx];
-
-		// 若当前字节为 '\r'，即回车符号，说明可能读到一个完整的行
-		if (text == '\r') {
-			// 如果其为 buffer
-			// 中最后一个已经被读入的客户数据，于是这次分析没有读取到一个完整的行
-			// 返回 LINE_OPEN
-			if ((m_checked_idx + 1) == m_read_idx)
-				return LINE_OPEN;
-			// 如果下一个字符为 '\n' 则说明已经读完一个完整的行
-			else if (m_read_buf[m_checked_idx + 1] == '\n') {
-				// 将 '\r\n' 使用空格代替
-				m_read_buf[m_checked_idx++] = '\0';
-				m_read_buf[m_checked_idx++] = '\0';
-				return LINE_OK;
-			}
+	m_has_content_length = false;
+	m_chunked = false;
+	m_handler = 0;
 
-			// 否则存在语法问题
-			else
+	// 剩余的流水线数据由最近一次读入带来，缓冲区为空时由下次读入更新
+	m_read_tsc = m_last_read_tsc;
+	m_parse_tsc = 0;
+}
+
+void http_conn::init_response() {
+	m_write_buf.clear();
+	m_pipeline_count = 0;
+	m_close_after_send = false;
+	m_iv_count = 0;
+	m_iv_overflow = false;
+	m_iv_idx = 0;
+	m_bytes_to_send = 0;
+	m_bytes_have_send = 0;
+	m_sendfile = false;
+	m_file_offset = 0;
+	m_write_tsc = 0;
+	m_access_count = 0;
+	m_log_buf.clear();
+}
+
+// 从状态机，增量查找请求头结束的空行
+// 逐个内存块以 SIMD 查找控制字符，合法的行中它只能是行尾 \r\n 的 \r
+// \r 与 \n 可以分处两个内存块或两次读入，由 m_scan_cr 衔接
+// 每个字节只检查一次，找到的行尾记录在 m_line_ends 中供解析时直接使用
+http_conn::LINE_STATUS http_conn::scan_header() {
+	size_t total = m_read_buf.size();
+
+	while ((size_t)m_checked_idx < total) {
+		size_t len;
+		const char* p = m_read_buf.segment(m_checked_idx, &len);
+
+		if (m_scan_cr) {
+			// 单独的 \r
+			if (*p != '\n')
 				return LINE_BAD;
-		}
 
-		// 当前字符为换行符，说明也有可能读到一个完整的行
-		else if (text == '\n') {
-			if ((m_checked_idx > 1) && m_read_buf[m_checked_idx - 1] == '\r') {
-				// 将 '\r\n' 使用空格代替
-				m_read_buf[m_checked_idx - 1] = '\0';
-				m_read_buf[m_checked_idx++] = '\0';
-				return LINE_OK;
-			} else
+			m_scan_cr = false;
+			m_checked_idx++;
+
+			int line_end = m_checked_idx - 2;
+
+			// 空行，请求行之前出现时请求非法，之后出现表示头部结束
+			if (line_end == m_start_line)
+				return m_check_state == CHECK_STATE_REQUESTLINE ? LINE_BAD : LINE_OK;
+
+			if (m_line_count > MAX_HEADERS)
 				return LINE_BAD;
+
+			m_line_ends[m_line_count++] = line_end;
+			m_start_line = m_checked_idx;
+			m_check_state = CHECK_STATE_HEADER;
+			continue;
 		}
+
+		const char* q = http_parser::find_ctl(p, p + len);
+		m_checked_idx += q - p;
+
+		// 本内存块中没有行尾，继续下一块
+		if (q == p + len)
+			continue;
+
+		// 单独的 \n 或其他控制字符
+		if (*q != '\r')
+			return LINE_BAD;
+
+		m_scan_cr = true;
+		m_checked_idx++;
 	}
-	// 如果分析完毕也没能读取到 '\r'字符，则说明还需继续读取
-	// 返回 LINE_OPEN
+
 	return LINE_OPEN;
 }
 
-// 循环读取客户端数据，直到无数据或对方关闭连接
+// 更新第一个内存块中连续数据的视图，读缓冲区变化后调用
+// 请求头已复制到 m_head_buf 时视图固定指向副本
+void http_conn::update_read_view() {
+	if (!m_head_buf.empty())
+		return;
+
+	m_read_data = m_read_buf.peek();
+	m_read_idx = m_read_buf.peek_size();
+}
+
+// 循环读取客户端数据，直到无数据、读缓冲区已满或对方关闭连接
+// 缓冲区已满时剩余数据留在 socket 中，处理完缓冲区中的请求后再读取
+// 追加读入的数据不改变已有数据的地址
 bool http_conn::read() {
-	if (m_read_idx >= READ_BUFFER_SIZE)
-		return false;
+	// 完成模式下数据已由 I/O 后端收取，经 read(data, len) 交来
+	if (m_stream)
+		return true;
 
-	int bytes_read = 0;
-	while (true) {
-		bytes_read = recv(m_sockfd, m_read_buf + m_read_idx,
-		                  READ_BUFFER_SIZE - m_read_idx, 0);
+	bool was_empty = m_read_buf.empty();
+	size_t before = m_read_buf.size();
+	ssize_t bytes_read = 0;
+	while (m_read_buf.size() < (size_t)m_max_read_size) {
+		bytes_read = m_read_buf.read_fd(m_sockfd);
 
 		if (bytes_read == -1) {
 			if (errno == EAGAIN || errno == EWOULDBLOCK)
@@ -159,376 +299,1898 @@ bool http_conn::read() {
 			return false;
 		}
 
-		m_read_idx += bytes_read;
 	}
 
+	if (m_read_buf.size() > before) {
+		metrics::add(MC_BYTES_IN, m_read_buf.size() - before);
+		m_last_read_tsc = server_log::rdtsc();
+		if (was_empty)
+			m_read_tsc = m_last_read_tsc;
+	}
+
+	update_read_view();
 	return true;
 }
 
-// 解析 HTTP 请求行
-http_conn::HTTP_CODE http_conn::parse_request_line(char* text) {
+// 完成模式下 I/O 后端收取的数据，复制到读缓冲区后后端的缓冲区即可归还
+void http_conn::read(const char* data, size_t len) {
+	bool was_empty = m_read_buf.empty();
+	m_read_buf.append(data, len);
+
+	metrics::add(MC_BYTES_IN, len);
+	m_last_read_tsc = server_log::rdtsc();
+	if (was_empty)
+		m_read_tsc = m_last_read_tsc;
+
+	update_read_view();
+}
+
+// 跳过空格与制表符
+static const char* skip_space(const char* p, const char* end) {
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	return p;
+}
+
+static bool is_digit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+// 在原处解码 %XX 并规范化以 '/' 开头的路径，返回新的长度，结果不长于原串
+// 合并重复的 '/'，去掉 "." 段，".." 段回退到上一段
+// 解码得到的 '/' 与 '.' 同样参与规范化，"%2e%2e" 与 ".." 等价，无法借编码越过根目录
+// ".." 越过根目录、%XX 不完整或解码出控制字符时返回 -1
+static int normalize_path(char* path, size_t len) {
+	const char* p = path + 1;
+	const char* end = path + len;
+	char* out = path + 1; // 每读入至少一个字节才写出一个字节，写位置不会超过读位置
+	char* seg = out;      // 当前段的起点
+
+	while (true) {
+		bool last = p == end;
+
+		if (!last) {
+			char c = *p++;
+
+			if (c == '%') {
+				int hi = end - p >= 2 ? hex_value(p[0]) : -1;
+				int lo = end - p >= 2 ? hex_value(p[1]) : -1;
+				if (hi < 0 || lo < 0)
+					return -1;
+
+				c = (char)(hi << 4 | lo);
+				p += 2;
 
-	m_url = strpbrk(text, " \t");
+				if ((unsigned char)c < 0x20 || c == 0x7f)
+					return -1;
+			}
+
+			if (c != '/') {
+				*out++ = c;
+				continue;
+			}
+		}
+
+		// 一段结束，空段即重复的 '/'，不写出
+		size_t seg_len = out - seg;
+
+		if (seg_len == 1 && seg[0] == '.') {
+			out = seg;
+		} else if (seg_len == 2 && seg[0] == '.' && seg[1] == '.') {
+			if (seg == path + 1)
+				return -1;
+
+			// seg[-1] 为上一段之后的 '/'，回退到上一段的起点
+			out = seg - 1;
+			while (out[-1] != '/')
+				out--;
+		} else if (seg_len > 0 && !last) {
+			*out++ = '/';
+		}
+
+		if (last)
+			break;
+
+		seg = out;
+	}
+
+	return out - path;
+}
+
+// 解析 HTTP 请求行
+http_conn::HTTP_CODE http_conn::parse_request_line(http_span line) {
+	const char* p = m_read_data + line.off;
+	const char* end = p + line.len;
 
 	// 如果请求行中没有空白字符或 "\t" 字符，则 HTTP请求存在问题
-	if (!m_url)
+	const char* sp = http_parser::find_char(p, end, ' ', '\t');
+	if (sp == end)
 		return BAD_REQUEST;
 
-	*m_url++ = '\0';
-
-	char* method = text;
-	// 此处仅支持 GET 方法
-	if (strcasecmp(method, "GET") == 0)
+	// 方法名区分大小写，不支持的方法应答 501
+	size_t method_len = sp - p;
+	if (method_len == 3 && memcmp(p, "GET", 3) == 0)
 		m_method = GET;
+	else if (method_len == 4 && memcmp(p, "HEAD", 4) == 0)
+		m_method = HEAD;
+	else if (method_len == 4 && memcmp(p, "POST", 4) == 0)
+		m_method = POST;
+	else if (method_len == 3 && memcmp(p, "PUT", 3) == 0)
+		m_method = PUT;
 	else
-		return BAD_REQUEST;
+		return NOT_IMPLEMENTED;
 
-	m_url += strspn(m_url, " \t");
-	m_version = strpbrk(m_url, " \t");
+	const char* url = skip_space(sp, end);
+	const char* url_end = http_parser::find_char(url, end, ' ', '\t');
 
-	if (!m_version)
+	if (url_end == end)
 		return BAD_REQUEST;
 
-	*m_version++ = '\0';
-	m_version += strspn(m_version, " \t");
-
-	// 仅支持 HTTP1.1
-	if (strcasecmp(m_version, "HTTP/1.1") != 0)
+	// 支持 HTTP/1.0 与 HTTP/1.1，其他格式正确的版本应答 505
+	const char* version = skip_space(url_end, end);
+	if (end - version != 8 || strncasecmp(version, "HTTP/", 5) != 0 ||
+	    version[6] != '.' || !is_digit(version[5]) || !is_digit(version[7]))
 		return BAD_REQUEST;
 
+	if (version[5] != '1' || version[7] > '1')
+		return VERSION_NOT_SUPPORTED;
+
+	m_version = version[7] - '0';
+
 	// 检查 m_url 是否合法
-	if (strncasecmp(m_url, "http://", 7) == 0) {
-		m_url += 7;
-		m_url = strchr(m_url, '/');
+	if (url_end - url >= 7 && strncasecmp(url, "http://", 7) == 0) {
+		url += 7;
+		url = (const char*)memchr(url, '/', url_end - url);
+	}
+
+	if (!url || url == url_end || url[0] != '/')
+		return BAD_REQUEST;
+
+	// 查询串与片段不属于路径，片段通常不会出现在请求中
+	const char* path_end = url;
+	while (path_end < url_end && *path_end != '?' && *path_end != '#')
+		path_end++;
+
+	if (path_end < url_end && *path_end == '?') {
+		const char* query = path_end + 1;
+		const char* query_end = (const char*)memchr(query, '#', url_end - query);
+		if (!query_end)
+			query_end = url_end;
+
+		m_query.off = query - m_read_data;
+		m_query.len = query_end - query;
 	}
 
-	if (!m_url || m_url[0] != '/')
+	// 请求行位于读缓冲区中，可在原处改写
+	char* path = m_read_data + (url - m_read_data);
+	int path_len = normalize_path(path, path_end - url);
+	if (path_len < 0)
 		return BAD_REQUEST;
 
-	printf("The request m_url is: %s\n", m_url);
+	m_url.off = url - m_read_data;
+	m_url.len = path_len;
+
+	logds("request url: {}", fmt::string_view(url, m_url.len));
 
-	// HTTP 请求行处理完毕，状态转移到头部字段的分析
-	m_check_state = CHECK_STATE_HEADER;
 	return NO_REQUEST;
 }
 
 // 解析 HTTP 的一个头部信息
-http_conn::HTTP_CODE http_conn::parse_headers(char* text) {
-
-	// 遇到空行
-	if (text[0] == '\0') {
-		// 如果存在消息体，对其进行读取
-		if (m_content_length != 0) {
-			m_check_state = CHECK_STATE_CONTENT;
-			return NO_REQUEST;
+// 字段名经完美哈希得到已知字段编号，字段以偏移记录在 m_headers 中
+http_conn::HTTP_CODE http_conn::parse_headers(http_span line) {
+	const char* name = m_read_data + line.off;
+	const char* end = name + line.len;
+	const char* colon = http_parser::find_char(name, end, ':', ':');
+
+	if (colon == end || colon == name || m_header_count >= MAX_HEADERS)
+		return BAD_REQUEST;
+
+	// 去除字段值首尾空白
+	const char* value = skip_space(colon + 1, end);
+	const char* value_end = end;
+	while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+		value_end--;
+
+	http_header& header = m_headers[m_header_count++];
+	header.id = http_parser::lookup_header(name, colon - name);
+	header.name.off = line.off;
+	header.name.len = colon - name;
+	header.value.off = value - m_read_data;
+	header.value.len = value_end - value;
+
+	size_t len = value_end - value;
+
+	switch (header.id) {
+	// 处理 connection 头部字段，值为逗号分隔的选项列表
+	case HDR_CONNECTION:
+		for (const char* p = value; p < value_end;) {
+			const char* comma = http_parser::find_char(p, value_end, ',', ',');
+			const char* token_end = comma;
+			while (token_end > p && (token_end[-1] == ' ' || token_end[-1] == '\t'))
+				token_end--;
+
+			size_t n = token_end - p;
+			if (n == 5 && strncasecmp(p, "close", 5) == 0)
+				m_conn_close = true;
+			else if (n == 10 && strncasecmp(p, "keep-alive", 10) == 0)
+				m_conn_keep_alive = true;
+
+			p = comma < value_end ? skip_space(comma + 1, value_end) : value_end;
 		}
+		break;
 
-		// 否则表示已经读取完全
-		else
-			return GET_REQUEST;
-	}
+	// 处理 Content-Length 头部字段，只接受十进制数字
+	// 重复出现且取值不同时无法确定消息体边界
+	case HDR_CONTENT_LENGTH: {
+		if (len == 0 || len > 18)
+			return BAD_REQUEST;
 
-	// 处理 connection 头部字段
-	else if (strncasecmp(text, "Connection:", 11) == 0) {
-		text += 11;
-		text += strspn(text, " \t");
-		if (strcasecmp(text, "keep-alive") == 0)
-			m_linger = true;
-	}
+		uint64_t content_length = 0;
+		for (const char* p = value; p < value_end; p++) {
+			if (*p < '0' || *p > '9')
+				return BAD_REQUEST;
+
+			content_length = content_length * 10 + (*p - '0');
+		}
+
+		if (m_has_content_length && m_content_length != content_length)
+			return BAD_REQUEST;
 
-	// 处理 Content-Length 头部字段
-	else if (strncasecmp(text, "Content-Length:", 15) == 0) {
-		text += 15;
-		text += strspn(text, " \t");
-		m_content_length = atol(text);
+		m_content_length = content_length;
+		m_has_content_length = true;
+		break;
 	}
 
+	// 只支持单独的 chunked，其他传输编码需要解压，应答 501
+	case HDR_TRANSFER_ENCODING:
+		if (len != 7 || strncasecmp(value, "chunked", 7) != 0)
+			return NOT_IMPLEMENTED;
+
+		m_chunked = true;
+		break;
+
 	// 处理 HOST 头部字段
-	else if (strncasecmp(text, "Host:", 5)) {
-		text += 5;
-		text += strspn(text, "\t");
-		m_host = text;
-	}
+	case HDR_HOST:
+		m_host = header.value;
+		break;
 
-	else
-		printf("oop! unknow header %s\n", text);
+	case HDR_UNKNOWN:
+		logds("unknown header: {}", fmt::string_view(name, colon - name));
+		break;
+
+	default:
+		break;
+	}
 
 	return NO_REQUEST;
 }
 
-// 并未真正对 HTTP 请求消息体进行解析，只是判断其是否被完全读入了
-http_conn::HTTP_CODE http_conn::parse_content(char* text) {
+// 请求头已完整，按扫描时记录的行尾依次解析请求行与各头部字段
+// 头部跨越内存块时先合并到连续内存，每个请求至多复制一次
+http_conn::HTTP_CODE http_conn::parse_header_block() {
+	if (m_read_idx < m_checked_idx) {
+		m_read_buf.pullup(m_checked_idx);
+		update_read_view();
+	}
+
+	int start = 0;
+	for (int i = 0; i < m_line_count; i++) {
+		http_span line = {(uint32_t)start, (uint32_t)(m_line_ends[i] - start)};
+		logds("header line: {}",
+		      fmt::string_view(m_read_data + line.off, line.len));
+
+		HTTP_CODE ret =
+		    i == 0 ? parse_request_line(line) : parse_headers(line);
+		if (ret != NO_REQUEST)
+			return ret;
+
+		start = m_line_ends[i] + 2;
+	}
+
+	return check_request();
+}
+
+// 请求头解析完后确定处理函数与消息体的读取方式
+// 不接受的方法与超出上限的消息体在读取消息体之前即被拒绝，不发送 100 Continue
+// 有消息体时将请求头复制到 m_head_buf，读缓冲区中的消息体随后边读边交付并丢弃
+http_conn::HTTP_CODE http_conn::check_request() {
+	// HTTP/1.1 默认保持连接，HTTP/1.0 需显式要求
+	m_linger = !m_conn_close && (m_version >= 1 || m_conn_keep_alive);
+
+	// 同时指定两者时消息体边界有歧义，可被用于请求走私
+	// HTTP/1.0 没有传输编码，出现时同样无法确定边界
+	if (m_chunked && (m_has_content_length || m_version == 0))
+		return BAD_REQUEST;
+
+	m_handler = match_handler();
+	METHOD method = m_method == HEAD ? GET : m_method;
+	if (!(m_handler->methods & (1u << method)))
+		return METHOD_NOT_ALLOWED;
 
-	if (m_read_idx >= (m_content_length + m_checked_idx)) {
-		text[m_content_length] = '\0';
+	if (!m_chunked && m_content_length == 0) {
+		m_check_state = CHECK_STATE_DONE;
 		return GET_REQUEST;
 	}
 
-	return NO_REQUEST;
+	if (!m_handler->on_body && m_content_length > (uint64_t)m_max_read_size)
+		return REQUEST_TOO_LARGE;
+
+	// 客户端等待 100 Continue 后才发送消息体，消息体已随请求头到达时无需发送
+	// HTTP/1.0 客户端不理解中间应答，忽略 Expect
+	const http_header* expect = m_version >= 1 ? find_header(HDR_EXPECT) : NULL;
+	if (expect) {
+		if (expect->value.len != 12 ||
+		    strncasecmp(get_span(expect->value), "100-continue", 12) != 0)
+			return EXPECTATION_FAILED;
+
+		if (m_read_buf.size() == (size_t)m_checked_idx &&
+		    !add_content(continue_form))
+			return INTERNAL_ERROR;
+	}
+
+	char* head = m_head_buf.reserve(m_checked_idx);
+	memcpy(head, m_read_data, m_checked_idx);
+	m_head_buf.commit(m_checked_idx);
+
+	m_read_buf.drain(m_checked_idx);
+	m_checked_idx = 0;
+	m_read_data = head;
+	m_read_idx = m_head_buf.peek_size();
+
+	if (m_chunked)
+		m_check_state = CHECK_STATE_CHUNK_SIZE;
+	else {
+		m_check_state = CHECK_STATE_CONTENT;
+		m_body_need = m_content_length;
+	}
+
+	return parse_content();
 }
 
-// 主状态机
-// 逐个调用上述实现函数解析请求行、HTTP头部和消息体
-http_conn::HTTP_CODE http_conn::process_read() {
-	LINE_STATUS line_status = LINE_OK;
-	HTTP_CODE ret = NO_REQUEST;
-	char* text = 0;
+// 读缓冲区头部一行的长度，包含结尾的 \r\n，行尚不完整时返回 0，非法时返回 -1
+// 行跨越内存块时合并，返回后该行位于 m_read_buf.peek() 处
+int http_conn::find_body_line() {
+	size_t avail = std::min(m_read_buf.size(), (size_t)MAX_CHUNK_LINE);
+	if (avail == 0)
+		return 0;
 
-	while (
-	    ((m_check_state == CHECK_STATE_CONTENT) && (line_status == LINE_OK)) ||
-	    ((line_status = parse_line()) == LINE_OK)) {
-		text = get_line();
-		m_start_line = m_checked_idx;
-		printf("got 1 http line:%s\n", text);
+	const char* p = m_read_buf.peek();
+	size_t n = std::min(m_read_buf.peek_size(), avail);
+	const char* lf = (const char*)memchr(p, '\n', n);
 
-		switch (m_check_state) {
-		case CHECK_STATE_REQUESTLINE: {
-			ret = parse_request_line(text);
+	if (!lf && n < avail) {
+		p = m_read_buf.pullup(avail);
+		lf = (const char*)memchr(p, '\n', avail);
+	}
 
-			if (ret == BAD_REQUEST)
-				return BAD_REQUEST;
-			else
-				break;
-		}
-		case CHECK_STATE_HEADER: {
-			ret = parse_headers(text);
+	if (!lf)
+		return avail < (size_t)MAX_CHUNK_LINE ? 0 : -1;
 
-			if (ret == BAD_REQUEST)
-				return BAD_REQUEST;
-			else if (ret == GET_REQUEST)
-				return do_request();
-			else
-				break;
+	if (lf == p || lf[-1] != '\r')
+		return -1;
+
+	return lf - p + 1;
+}
+
+// 解析块大小行，块扩展被忽略
+http_conn::HTTP_CODE http_conn::parse_chunk_size() {
+	int len = find_body_line();
+	if (len <= 0)
+		return len == 0 ? NO_REQUEST : BAD_REQUEST;
+
+	const char* p = m_read_buf.peek();
+	const char* end = p + len - 2;
+	const char* q = p;
+
+	uint64_t size = 0;
+	for (; q < end; q++) {
+		int v = hex_value(*q);
+		if (v < 0)
+			break;
+
+		// 超过 2^60 的块大小视为非法
+		if (size >> 56)
+			return BAD_REQUEST;
+		size = size * 16 + v;
+	}
+
+	if (q == p)
+		return BAD_REQUEST;
+
+	q = skip_space(q, end);
+	if (q != end && *q != ';')
+		return BAD_REQUEST;
+
+	m_read_buf.drain(len);
+
+	if (size == 0)
+		m_check_state = CHECK_STATE_TRAILER;
+	else {
+		m_check_state = CHECK_STATE_CONTENT;
+		m_body_need = size;
+	}
+
+	return GET_REQUEST;
+}
+
+// 跳过尾部字段直到空行
+http_conn::HTTP_CODE http_conn::parse_trailer() {
+	while (true) {
+		int len = find_body_line();
+		if (len <= 0)
+			return len == 0 ? NO_REQUEST : BAD_REQUEST;
+
+		m_read_buf.drain(len);
+
+		if (len == 2) {
+			m_check_state = CHECK_STATE_DONE;
+			return GET_REQUEST;
 		}
-		case CHECK_STATE_CONTENT: {
-			ret = parse_content(text);
 
-			if (ret == GET_REQUEST)
-				return do_request();
+		if (++m_trailer_count > MAX_HEADERS)
+			return BAD_REQUEST;
+	}
+}
+
+// 将读缓冲区头部 len 字节的消息体按内存块依次交给处理函数或缓存，随后丢弃
+http_conn::HTTP_CODE http_conn::deliver_body(size_t len) {
+	while (len > 0) {
+		size_t n;
+		const char* data = m_read_buf.segment(0, &n);
+		n = std::min(n, len);
+
+		HTTP_CODE ret = NO_REQUEST;
+		if (m_handler->on_body)
+			ret = m_handler->on_body(this, data, n);
+		else if (m_body_buf.size() + n > (size_t)m_max_read_size)
+			ret = REQUEST_TOO_LARGE;
+		else
+			m_body_buf.append(data, n);
+
+		m_read_buf.drain(n);
+		len -= n;
+		m_body_need -= n;
+		m_body_received += n;
+
+		if (ret != NO_REQUEST)
+			return ret;
+	}
+
+	return NO_REQUEST;
+}
+
+// 消息体状态机，读入多少交付多少，不等待消息体完整
+// Content-Length 消息体只经过 CONTENT 状态，chunked 消息体在各状态间循环
+// 各步骤以 GET_REQUEST 表示有进展，NO_REQUEST 表示需要更多数据
+http_conn::HTTP_CODE http_conn::parse_content() {
+	while (true) {
+		HTTP_CODE ret;
+
+		switch (m_check_state) {
+		case CHECK_STATE_CONTENT:
+			ret = deliver_body(std::min<size_t>(m_body_need, m_read_buf.size()));
+			if (ret != NO_REQUEST)
+				return ret;
+			if (m_body_need > 0)
+				return NO_REQUEST;
+
+			m_check_state = m_chunked ? CHECK_STATE_CHUNK_END : CHECK_STATE_DONE;
+			ret = GET_REQUEST;
+			break;
+
+		case CHECK_STATE_CHUNK_SIZE:
+			ret = parse_chunk_size();
+			break;
+
+		// 块数据之后只能是空行
+		case CHECK_STATE_CHUNK_END: {
+			int len = find_body_line();
+			if (len <= 0)
+				return len == 0 ? NO_REQUEST : BAD_REQUEST;
+			if (len != 2)
+				return BAD_REQUEST;
 
-			line_status = LINE_OPEN;
+			m_read_buf.drain(len);
+			m_check_state = CHECK_STATE_CHUNK_SIZE;
+			ret = GET_REQUEST;
 			break;
 		}
+
+		case CHECK_STATE_TRAILER:
+			ret = parse_trailer();
+			break;
+
+		case CHECK_STATE_DONE:
+			return GET_REQUEST;
+
 		default:
-			return INTERNAL_ERROR;
+			return BAD_REQUEST;
 		}
+
+		if (ret != GET_REQUEST)
+			return ret;
+	}
+}
+
+const char* http_conn::get_body(size_t* len) {
+	*len = m_body_buf.size();
+	return m_body_buf.pullup(*len);
+}
+
+const http_header* http_conn::find_header(HTTP_HEADER id) const {
+	for (int i = 0; i < m_header_count; i++) {
+		if (m_headers[i].id == id)
+			return &m_headers[i];
+	}
+
+	return NULL;
+}
+
+// 主状态机
+// 先增量查找请求头的结束位置，头部完整后一次解析，再边读入边交付消息体
+// 请求不完整时返回 NO_REQUEST，全部状态保存在连接中，下次从断点继续
+http_conn::HTTP_CODE http_conn::process_read() {
+	if (m_check_state >= CHECK_STATE_CONTENT)
+		return parse_content();
+
+	switch (scan_header()) {
+	case LINE_OK:
+		return parse_header_block();
+	case LINE_BAD:
+		return BAD_REQUEST;
+	default:
+		return NO_REQUEST;
 	}
+}
+
+// 按 URL 前缀查找请求处理函数，未匹配时按静态文件处理
+// 前缀只在路径段边界上匹配：/upload 匹配 /upload 与 /upload/a，不匹配 /uploads 与 /upload.html
+const http_conn::handler* http_conn::match_handler() const {
+	const char* url = get_url();
+
+	for (size_t i = 0; i < m_handlers.size(); i++) {
+		const handler& h = m_handlers[i];
+		if (m_url.len < h.prefix_len || strncmp(url, h.prefix, h.prefix_len) != 0)
+			continue;
+
+		if (m_url.len == h.prefix_len || url[h.prefix_len] == '/' ||
+		    url[h.prefix_len] == '?' || h.prefix[h.prefix_len - 1] == '/')
+			return &h;
+	}
+
+	return &m_static_handler;
+}
+
+http_conn::HTTP_CODE http_conn::serve_static(http_conn* conn) {
+	return conn->do_request();
+}
+
+http_conn::HTTP_CODE http_conn::serve_metrics(http_conn* conn) {
+	std::string body;
+	metrics::render(&body);
+	conn->set_content(body.data(), body.size(),
+	                  "text/plain; version=0.0.4; charset=utf-8");
+	return CONTENT_REQUEST;
+}
 
+// 消息体交付后即被丢弃，收到的字节数由 body_received 统计
+http_conn::HTTP_CODE http_conn::discard_body(http_conn*, const char*, size_t) {
 	return NO_REQUEST;
 }
 
+http_conn::HTTP_CODE http_conn::serve_upload(http_conn* conn) {
+	char buf[64];
+	int len = snprintf(buf, sizeof(buf), "received %zu bytes\n",
+	                   conn->body_received());
+	conn->set_content(buf, len, "text/plain");
+	return CONTENT_REQUEST;
+}
+
+void http_conn::set_content(const char* data, size_t len,
+                            const char* content_type) {
+	char* buf = m_write_buf.reserve(len);
+	memcpy(buf, data, len);
+	m_write_buf.commit(len);
+
+	m_content = buf;
+	m_content_len = len;
+	m_content_type = content_type;
+}
+
+// 执行匹配到的请求处理函数
+http_conn::HTTP_CODE http_conn::do_handler() {
+	if (!m_handler)
+		m_handler = match_handler();
+
+	return m_handler->func(this);
+}
+
 // 当为一个完整的 HTTP请求时，分析目标文件属性
-// 如果目标文件用户状态有效，则使用 mmap 将其映射到 m_file_address
+// 如果目标文件用户状态有效，则从文件缓存借用其映射 m_file_address
 // 并回复文件调用成功
+// 请求路径在解析请求行时已规范化，直接作为文件缓存的键值
 http_conn::HTTP_CODE http_conn::do_request() {
-	strcpy(m_real_file, doc_root);
-	int len = strlen(doc_root);
-	strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
-
-	if (stat(m_real_file, &m_file_stat) < 0)
+	switch (file_cache::instance().acquire(get_url(), m_url.len, &m_file)) {
+	case file_cache::FILE_OK:
+		break;
+	case file_cache::FILE_NOT_FOUND:
 		return NO_RESOURCE;
-
-	if (!(m_file_stat.st_mode & S_IROTH))
+	case file_cache::FILE_FORBIDDEN:
 		return FORBIDDEN_REQUEST;
-
-	if (S_ISDIR(m_file_stat.st_mode))
+	case file_cache::FILE_IS_DIR:
 		return BAD_REQUEST;
+	default:
+		return INTERNAL_ERROR;
+	}
+
+	if (m_file->st.st_size > 0 && m_file->type->compressible)
+		select_encoding();
+
+	m_file_address = m_file->address;
+	m_file_stat = &m_file->st;
+
+	if ((m_method == GET || m_method == HEAD) && not_modified())
+		return NOT_MODIFIED;
+
+	// 只有 GET 请求处理 Range，HEAD 与空文件忽略
+	if (m_method == GET && m_file->st.st_size > 0 && find_header(HDR_RANGE) &&
+	    if_range_matches())
+		return parse_range();
 
-	int fd = open(m_real_file, O_RDONLY);
-	m_file_address =
-	    (char*)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	close(fd);
 	return FILE_REQUEST;
 }
 
-// 对内存映射区执行 munmap 操作
-void http_conn::unmap() {
-	if (m_file_address) {
-		munmap(m_file_address, m_file_stat.st_size);
-		m_file_address = 0;
+// 返回 Accept-Encoding 中 q 值大于 0 的编码，未列出的编码按 * 处理
+static int accepted_encodings(const char* p, const char* end) {
+	int listed = 0;
+	int accepted = 0;
+	bool any = false;
+
+	while (p < end) {
+		p = skip_space(p, end);
+		const char* comma = http_parser::find_char(p, end, ',', ',');
+		const char* semi = http_parser::find_char(p, comma, ';', ';');
+
+		const char* name_end = semi;
+		while (name_end > p && (name_end[-1] == ' ' || name_end[-1] == '\t'))
+			name_end--;
+		size_t name_len = name_end - p;
+
+		// q=0、q=0.0 等表示不接受，只需判断是否全为 0
+		bool refused = false;
+		const char* q = semi < comma ? skip_space(semi + 1, comma) : comma;
+		if (comma - q >= 2 && (q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+			refused = true;
+			for (q += 2; q < comma && *q != ' ' && *q != '\t' && *q != ';'; q++) {
+				if (*q != '0' && *q != '.')
+					refused = false;
+			}
+		}
+
+		int encoding = 0;
+		if (name_len == 4 && strncasecmp(p, "gzip", 4) == 0)
+			encoding = ENCODING_GZIP;
+		else if (name_len == 6 && strncasecmp(p, "x-gzip", 6) == 0)
+			encoding = ENCODING_GZIP;
+		else if (name_len == 2 && strncasecmp(p, "br", 2) == 0)
+			encoding = ENCODING_BR;
+		else if (name_len == 1 && *p == '*')
+			any = !refused;
+
+		listed |= encoding;
+		if (!refused)
+			accepted |= encoding;
+
+		p = comma < end ? comma + 1 : end;
 	}
+
+	if (any)
+		accepted |= (ENCODING_GZIP | ENCODING_BR) & ~listed;
+	return accepted;
 }
 
-// 写 HTTP 响应
-// epoll 事件处理
-bool http_conn::write() {
-	int temp = 0;
-	int bytes_have_send = 0;
-	int bytes_to_send = m_write_idx;
+// 按 Accept-Encoding 选择文件的表示，依次尝试预压缩的 .br、.gz 与即时 gzip 压缩
+// 选中压缩表示时以其替换 m_file，之后的条件请求与 Range 均针对该表示
+// reactor 线程中不等待压缩，未命中时交给线程池，压缩完成前发送原文件
+void http_conn::select_encoding() {
+	const http_header* header = find_header(HDR_ACCEPT_ENCODING);
+	if (!header)
+		return;
+
+	const char* value = get_span(header->value);
+	int accepted = accepted_encodings(value, value + header->value.len);
+	if (!accepted)
+		return;
+
+	file_cache& cache = file_cache::instance();
+	file_entry* encoded = NULL;
+
+	if (m_precompressed.load(std::memory_order_relaxed)) {
+		static const struct {
+			int encoding;
+			const char* name;
+			const char* suffix;
+		} siblings[] = {{ENCODING_BR, "br", ".br"}, {ENCODING_GZIP, "gzip", ".gz"}};
+
+		// 兄弟文件的键在栈上拼接，放不下时文件路径也超出了 PATH_MAX
+		char name[PATH_MAX];
+		size_t url_len = m_url.len;
+
+		for (size_t i = 0; !encoded && i < sizeof(siblings) / sizeof(siblings[0]);
+		     i++) {
+			if (!(accepted & m_file->precompressed & siblings[i].encoding))
+				continue;
+
+			size_t suffix_len = strlen(siblings[i].suffix);
+			if (url_len + suffix_len > sizeof(name))
+				continue;
+
+			memcpy(name, get_url(), url_len);
+			memcpy(name + url_len, siblings[i].suffix, suffix_len);
+			if (cache.acquire(name, url_len + suffix_len, &encoded,
+			                  siblings[i].name) != file_cache::FILE_OK)
+				encoded = NULL;
+		}
+	}
+
+	off_t size = m_file->st.st_size;
+	if (!encoded && (accepted & ENCODING_GZIP) &&
+	    size >= m_compress_min_size.load(std::memory_order_relaxed) &&
+	    size <= m_compress_max_size.load(std::memory_order_relaxed) &&
+	    !cache.acquire_compressed(m_file, &encoded, m_on_reactor))
+		encoded = NULL;
+
+	if (!encoded)
+		return;
 
-	if (bytes_to_send == 0) {
-		modfd(m_epollfd, m_sockfd, EPOLLIN);
-		init();
+	cache.release(m_file);
+	m_file = encoded;
+}
+
+// 没有 If-Range 或其校验值与文件相符时处理 Range，否则发送整个文件
+// If-Range 要求强校验：ETag 完全相同，日期与 Last-Modified 完全相同
+bool http_conn::if_range_matches() const {
+	const http_header* if_range = find_header(HDR_IF_RANGE);
+	if (!if_range)
+		return true;
+
+	const char* value = get_span(if_range->value);
+	size_t len = if_range->value.len;
+
+	if (len > 0 && value[0] == '"')
+		return len == m_file->etag.size() &&
+		       memcmp(value, m_file->etag.data(), len) == 0;
+
+	char date[http_date::DATE_LEN];
+	http_date::format(m_file->st.st_mtime, date);
+	return len == sizeof(date) && memcmp(value, date, len) == 0;
+}
+
+// 解析十进制数，为空时返回 0，非法或超过 18 位时返回 -1
+static int parse_offset(const char* p, const char* end, uint64_t* value) {
+	if (p == end)
+		return 0;
+	if (end - p > 18)
+		return -1;
+
+	uint64_t v = 0;
+	for (; p < end; p++) {
+		if (!is_digit(*p))
+			return -1;
+		v = v * 10 + (*p - '0');
+	}
+
+	*value = v;
+	return 1;
+}
+
+// 解析 Range: bytes=first-last, first-, -suffix, ...
+// 语法错误、不是 bytes 单位或区间过多时忽略 Range，发送整个文件
+// 超出文件大小的区间被丢弃，全部被丢弃时应答 416
+// 区间按起点排序，重叠或相邻的合并，避免重复发送同一段内容
+http_conn::HTTP_CODE http_conn::parse_range() {
+	const http_header* range = find_header(HDR_RANGE);
+	const char* p = get_span(range->value);
+	const char* end = p + range->value.len;
+
+	if (end - p < 6 || strncasecmp(p, "bytes=", 6) != 0)
+		return FILE_REQUEST;
+	p += 6;
+
+	uint64_t size = m_file->st.st_size;
+	int specs = 0;
+	int count = 0;
+
+	while (p < end) {
+		const char* comma = http_parser::find_char(p, end, ',', ',');
+		const char* spec = skip_space(p, comma);
+		const char* spec_end = comma;
+		while (spec_end > spec && (spec_end[-1] == ' ' || spec_end[-1] == '\t'))
+			spec_end--;
+
+		p = comma < end ? comma + 1 : end;
+
+		// 列表中允许空元素
+		if (spec == spec_end)
+			continue;
+
+		if (++specs > MAX_RANGES)
+			return FILE_REQUEST;
+
+		const char* dash = http_parser::find_char(spec, spec_end, '-', '-');
+		if (dash == spec_end)
+			return FILE_REQUEST;
+
+		uint64_t first = 0, last = 0;
+		int has_first = parse_offset(spec, dash, &first);
+		int has_last = parse_offset(dash + 1, spec_end, &last);
+		if (has_first < 0 || has_last < 0 || (!has_first && !has_last))
+			return FILE_REQUEST;
+
+		byte_range r;
+		if (!has_first) {
+			// 最后 last 字节
+			if (last == 0)
+				continue;
+			r.start = last >= size ? 0 : size - last;
+			r.end = size;
+		} else {
+			if (has_last && last < first)
+				return FILE_REQUEST;
+			if (first >= size)
+				continue;
+			r.start = first;
+			r.end = (!has_last || last >= size - 1) ? size : last + 1;
+		}
+
+		m_ranges[count++] = r;
+	}
+
+	if (specs == 0)
+		return FILE_REQUEST;
+	if (count == 0)
+		return RANGE_NOT_SATISFIABLE;
+
+	std::sort(m_ranges, m_ranges + count,
+	          [](const byte_range& a, const byte_range& b) {
+		          return a.start < b.start;
+	          });
+
+	m_range_count = 1;
+	for (int i = 1; i < count; i++) {
+		byte_range& last = m_ranges[m_range_count - 1];
+		if (m_ranges[i].start <= last.end)
+			last.end = std::max(last.end, m_ranges[i].end);
+		else
+			m_ranges[m_range_count++] = m_ranges[i];
+	}
+
+	return PARTIAL_CONTENT;
+}
+
+// ETag 列表中的一项，去掉弱校验前缀 W/
+static bool etag_listed(const char* p, const char* end, const std::string& etag) {
+	while (p < end) {
+		p = skip_space(p, end);
+		const char* comma = http_parser::find_char(p, end, ',', ',');
+		const char* tag_end = comma;
+		while (tag_end > p && (tag_end[-1] == ' ' || tag_end[-1] == '\t'))
+			tag_end--;
+
+		if (tag_end - p >= 2 && p[0] == 'W' && p[1] == '/')
+			p += 2;
+
+		size_t n = tag_end - p;
+		if ((n == 1 && *p == '*') ||
+		    (n == etag.size() && memcmp(p, etag.data(), n) == 0))
+			return true;
+
+		p = comma + 1;
+	}
+
+	return false;
+}
+
+// 条件请求的文件是否未变化
+// 有 If-None-Match 时忽略 If-Modified-Since，按弱比较匹配 ETag
+// 浏览器通常原样带回 Last-Modified，先按字符串比较，不同时再解析日期
+bool http_conn::not_modified() const {
+	if (m_file->etag.empty())
+		return false;
+
+	const http_header* inm = find_header(HDR_IF_NONE_MATCH);
+	if (inm) {
+		const char* p = get_span(inm->value);
+		return etag_listed(p, p + inm->value.len, m_file->etag);
+	}
+
+	const http_header* ims = find_header(HDR_IF_MODIFIED_SINCE);
+	if (!ims)
+		return false;
+
+	const char* value = get_span(ims->value);
+	char date[http_date::DATE_LEN];
+	http_date::format(m_file->st.st_mtime, date);
+	if (ims->value.len == sizeof(date) && memcmp(value, date, sizeof(date)) == 0)
 		return true;
+
+	time_t since;
+	return http_date::parse(value, ims->value.len, &since) &&
+	       m_file->st.st_mtime <= since;
+}
+
+// 归还借用的文件映射，由文件缓存决定何时 munmap
+void http_conn::unmap() {
+	if (m_file) {
+		file_cache::instance().release(m_file);
+		m_file = 0;
+		m_file_address = 0;
+		m_file_stat = 0;
 	}
 
-	while (1) {
-		temp = writev(m_sockfd, m_iv, m_iv_count);
+	for (int i = 0; i < m_send_file_count; i++)
+		file_cache::instance().release(m_send_files[i]);
+	m_send_file_count = 0;
+}
+
+// 写 HTTP 响应
+// 发送队列中的全部应答合并为一次 writev，部分发送时从断点继续
+// 完成模式下交给 I/O 后端发送，由 send_done 处理完成事件；sendfile 仍在此同步发送
+// I/O 后端事件处理
+bool http_conn::write() {
+	if (m_stream && !m_sendfile && m_bytes_to_send > 0)
+		return submit_send();
+
+	ssize_t temp = 0;
+
+	while (m_bytes_to_send > 0) {
+		// sendfile 模式先以 MSG_MORE 发送队列中的头部，避免头部单独成包
+		// 头部发送完毕后由内核直接从文件缓存的 fd 发送最后一个应答的文件内容
+		bool use_iov = m_iv_idx < m_iv_count;
+
+		if (use_iov && !m_sendfile)
+			temp = writev(m_sockfd, m_iv + m_iv_idx, m_iv_count - m_iv_idx);
+		else if (use_iov) {
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = m_iv + m_iv_idx;
+			msg.msg_iovlen = m_iv_count - m_iv_idx;
+			temp = sendmsg(m_sockfd, &msg, MSG_MORE);
+		} else
+			temp = sendfile(m_sockfd, m_send_files[m_send_file_count - 1]->fd,
+			                &m_file_offset, m_bytes_to_send);
 
 		if (temp <= -1) {
 			// 若写缓冲区没有空间，此时等待下一个 EPOLLOUT事件
 			// 此时无法接收同用户下一请求，但可用保证连接的完整性
+			// 已发送字节数与文件偏移均已记录，下次从断点继续
 
 			if (errno == EAGAIN) {
-				modfd(m_epollfd, m_sockfd, EPOLLOUT);
+				modfd(m_backend, m_sockfd, m_handle, EPOLLOUT);
 				return true;
 			}
 			unmap();
 			return false;
 		}
 
-		bytes_to_send -= temp;
-		bytes_have_send += temp;
-
-		if (bytes_to_send <= bytes_have_send) {
+		// 仍有待发送的内容却没有发出任何数据，只会是 sendfile 读到了文件末尾：
+		// 文件在加载后被截断，inotify 尚未使缓存项失效，剩余内容已无法发送
+		if (temp == 0) {
+			if (!use_iov) {
+				file_entry* file = m_send_files[m_send_file_count - 1];
+				logwl(1000000000, "{} truncated while sending, {} bytes unsent",
+				      file->path, m_bytes_to_send);
+				file_cache::instance().discard(file);
+			}
 			unmap();
+			return false;
+		}
 
-			if (m_linger) {
-				init();
-				modfd(m_epollfd, m_sockfd, EPOLLIN);
-				return true;
-			} else {
-				modfd(m_epollfd, m_sockfd, EPOLLIN);
-				return false;
-			}
+		consume(temp, use_iov);
+	}
+
+	return finish_send();
+}
+
+// 记下发出的字节数，跳过已发送完的 iovec，调整部分发送的 iovec 起点
+void http_conn::consume(ssize_t bytes, bool use_iov) {
+	if (m_write_tsc == 0)
+		m_write_tsc = server_log::rdtsc();
+
+	m_bytes_to_send -= bytes;
+	m_bytes_have_send += bytes;
+	metrics::add(MC_BYTES_OUT, bytes);
+
+	while (use_iov && bytes > 0) {
+		struct iovec& iv = m_iv[m_iv_idx];
+
+		if ((size_t)bytes >= iv.iov_len) {
+			bytes -= iv.iov_len;
+			iv.iov_len = 0;
+			m_iv_idx++;
+		} else {
+			iv.iov_base = (char*)iv.iov_base + bytes;
+			iv.iov_len -= bytes;
+			bytes = 0;
 		}
 	}
 }
 
-// 往写缓冲区中写入待发送的数据
-bool http_conn::add_response(const char* format, ...) {
-	if (m_write_idx >= WRITE_BUFFER_SIZE)
+// 发送队列已全部发出
+bool http_conn::finish_send() {
+	bool recv_after = m_recv_after;
+	m_recv_after = false;
+
+	unmap();
+	report_access();
+
+	bool close = m_close_after_send;
+	init_response();
+
+	if (close)
 		return false;
 
-	va_list arg_list;
-	va_start(arg_list, format);
+	// 读缓冲区中还有流水线请求时不重新注册读事件，由调用者立即解析
+	if (!m_read_buf.empty()) {
+		m_pipelined = true;
+		return true;
+	}
+
+	// 后端已在发送完毕后接着接收
+	if (!recv_after)
+		modfd(m_backend, m_sockfd, m_handle, EPOLLIN);
+	return true;
+}
 
-	int len = vsnprintf(m_write_buf + m_write_idx,
-	                    WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list);
+// 发送队列交给 I/O 后端，读缓冲区中没有流水线请求且保持连接时发送完毕即接着接收，
+// 下一个请求无需再注册读事件
+bool http_conn::submit_send() {
+	m_msg.msg_iov = m_iv + m_iv_idx;
+	m_msg.msg_iovlen = m_iv_count - m_iv_idx;
+	m_recv_after = m_read_buf.empty() && !m_close_after_send;
 
-	if (len >= WRITE_BUFFER_SIZE - 1 - m_write_idx)
+	if (!m_backend->send(m_sockfd, &m_msg, m_recv_after)) {
+		m_recv_after = false;
+		unmap();
 		return false;
+	}
 
-	m_write_idx += len;
-	va_end(arg_list);
+	m_sending = true;
 	return true;
 }
 
-bool http_conn::add_status_line(int status, const char* title) {
-	return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
+// 发送被取消、出错或没有发出数据时关闭连接
+// 未全部发出时链接的接收已被取消，从断点重新提交
+bool http_conn::send_done(int res) {
+	m_sending = false;
+
+	if (res <= 0 || m_send_canceled) {
+		m_recv_after = false;
+		unmap();
+		return false;
+	}
+
+	consume(res, true);
+	if (m_bytes_to_send > 0)
+		return submit_send();
+
+	return finish_send();
+}
+
+void http_conn::cancel_send() {
+	if (m_sending && !m_send_canceled) {
+		m_send_canceled = true;
+		m_backend->cancel_send(m_sockfd);
+	}
+}
+
+// 预先生成的状态行，应答时直接复制
+struct status_line {
+	int status;
+	const char* text;
+	size_t len;
+};
+
+#define STATUS_LINE(status, title)                                             \
+	{ status, "HTTP/1.1 " #status " " title "\r\n",                            \
+	  sizeof("HTTP/1.1 " #status " " title "\r\n") - 1 }
+
+static const status_line status_lines[] = {
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(206, "Partial Content"),
+    STATUS_LINE(304, "Not Modified"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(403, "Forbidden"),
+    STATUS_LINE(404, "Not Found"),
+    STATUS_LINE(405, "Method Not Allowed"),
+    STATUS_LINE(413, "Payload Too Large"),
+    STATUS_LINE(416, "Range Not Satisfiable"),
+    STATUS_LINE(417, "Expectation Failed"),
+    STATUS_LINE(500, "Internal Error"),
+    STATUS_LINE(501, "Not Implemented"),
+    STATUS_LINE(505, "HTTP Version Not Supported"),
+};
+
+#undef STATUS_LINE
+
+// 每个应答各不相同的 Date 与 Connection 行不超过该长度
+static const size_t COMMON_HEADERS_SIZE = 64;
+
+// 头部块的固定部分
+// Content-Length 行加上 Date、Connection 行和空行不超过该长度
+static const size_t HEADER_BLOCK_SIZE = 128;
+
+static const char digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// 十进制写出无符号整数，每次除法产生两位，返回写入的末尾
+static char* format_uint(char* p, uint64_t v) {
+	char tmp[20];
+	char* t = tmp + sizeof(tmp);
+
+	while (v >= 100) {
+		int i = (v % 100) * 2;
+		v /= 100;
+		*--t = digit_pairs[i + 1];
+		*--t = digit_pairs[i];
+	}
+
+	if (v >= 10) {
+		*--t = digit_pairs[v * 2 + 1];
+		*--t = digit_pairs[v * 2];
+	} else
+		*--t = '0' + v;
+
+	size_t len = tmp + sizeof(tmp) - t;
+	memcpy(p, t, len);
+	return p + len;
+}
+
+static char* append(char* p, const char* data, size_t len) {
+	memcpy(p, data, len);
+	return p + len;
+}
+
+template <size_t N> static char* append(char* p, const char (&literal)[N]) {
+	return append(p, literal, N - 1);
 }
 
-bool http_conn::add_headers(int content_len) {
+// 往写缓冲区中复制待发送的数据，并追加到发送队列
+// 尾部内存块剩余空间不足时换到新块，保证数据连续
+bool http_conn::add_bytes(const char* data, size_t len) {
+	if (len >= buffer_pool::instance().chunk_capacity())
+		return false;
+
+	char* buf = m_write_buf.reserve(len);
+	memcpy(buf, data, len);
+	m_write_buf.commit(len);
+	add_iov(buf, len);
+	return true;
+}
 
-	bool flag = 1;
-	flag = flag && add_content_length(content_len);
-	flag = flag && add_linger();
-	flag = flag && add_blank_line();
+// 写出状态行，buf 至少 32 字节
+// 未预先生成的状态码，原因短语可以为空
+static size_t format_status_line(char* buf, int status, const char** line) {
+	for (size_t i = 0; i < sizeof(status_lines) / sizeof(status_lines[0]); i++) {
+		if (status_lines[i].status == status) {
+			*line = status_lines[i].text;
+			return status_lines[i].len;
+		}
+	}
 
-	return flag;
+	char* p = append(buf, "HTTP/1.1 ");
+	p = format_uint(p, status);
+	p = append(p, " \r\n");
+	*line = buf;
+	return p - buf;
 }
 
-bool http_conn::add_content_length(int content_len) {
-	return add_response("Content-Length: %d\r\n", content_len);
+bool http_conn::add_status_line(int status) {
+	m_status = status;
+
+	char buf[32];
+	const char* line;
+	size_t len = format_status_line(buf, status, &line);
+	return add_bytes(line, len);
 }
 
-bool http_conn::add_linger() {
-	return add_response("Connection:%s\r\n",
-	                    (m_linger == true) ? "keep-alive" : "close");
+// Date 与 Connection 行，不含结束头部的空行
+char* http_conn::put_common_headers(char* p) const {
+	size_t date_len;
+	const char* date = http_date::header(&date_len);
+	p = append(p, date, date_len);
+
+	if (m_linger)
+		return append(p, "Connection: keep-alive\r\n");
+	return append(p, "Connection: close\r\n");
 }
 
-bool http_conn::add_blank_line() { return add_response("%s", "\r\n"); }
+// 一次写出状态行之后的全部头部与空行
+// content_type 为 NULL 时不输出 Content-Type
+bool http_conn::add_headers(size_t content_len, const char* content_type) {
+	size_t type_len = content_type ? strlen(content_type) : 0;
+
+	size_t reserve_len = HEADER_BLOCK_SIZE;
+	if (content_type)
+		reserve_len += sizeof("Content-Type: \r\n") - 1 + type_len;
+
+	if (reserve_len >= buffer_pool::instance().chunk_capacity())
+		return false;
+
+	char* start = m_write_buf.reserve(reserve_len);
+	char* p = start;
+
+	if (content_type) {
+		p = append(p, "Content-Type: ");
+		p = append(p, content_type, type_len);
+		p = append(p, "\r\n");
+	}
+
+	p = append(p, "Content-Length: ");
+	p = format_uint(p, content_len);
+	p = append(p, "\r\n");
+	p = put_common_headers(p);
+	p = append(p, "\r\n");
+
+	m_write_buf.commit(p - start);
+	add_iov(start, p - start);
+	return true;
+}
 
 bool http_conn::add_content(const char* content) {
-	return add_response("%s", content);
+	return add_bytes(content, strlen(content));
 }
 
-// 根据服务器处理 HTTP 请求结果，决定返回客户端内容
-bool http_conn::process_write(HTTP_CODE ret) {
-	switch (ret) {
-	case INTERNAL_ERROR: {
-		add_status_line(500, error_500_title);
-		add_headers(strlen(error_500_form));
+// 共享的应答直接加入发送队列，不做复制
+// 只有 Date 与 Connection 行写入写缓冲区，插在固定头部与空行之间
+// body 为假时（HEAD 请求）只发送到空行为止
+bool http_conn::add_prerendered(const prerendered& response, bool body) {
+	if (response.status == 0)
+		return false;
 
-		if (!add_content(error_500_form))
-			return false;
+	m_status = response.status;
 
-		break;
+	char* data = (char*)response.data.data();
+	add_iov(data, response.head_len);
+
+	char* start = m_write_buf.reserve(COMMON_HEADERS_SIZE);
+	char* p = put_common_headers(start);
+	m_write_buf.commit(p - start);
+	add_iov(start, p - start);
+
+	size_t tail_len = response.data.size() - response.head_len;
+	add_iov(data + response.head_len, body ? tail_len : 2);
+	return true;
+}
+
+// headers 不为 NULL 时为追加在固定头部之后的完整头部行
+void http_conn::render(prerendered* response, int status,
+                       const char* content_type, const char* body,
+                       size_t len, const std::string* headers) {
+	char buf[32];
+	const char* line;
+	size_t line_len = format_status_line(buf, status, &line);
+
+	std::string& data = response->data;
+	data.clear();
+	data.reserve(line_len + HEADER_BLOCK_SIZE + len);
+	data.append(line, line_len);
+
+	if (content_type) {
+		data.append("Content-Type: ");
+		data.append(content_type);
+		data.append("\r\n");
 	}
-	case BAD_REQUEST: {
-		add_status_line(400, error_400_title);
-		add_headers(strlen(error_400_form));
 
-		if (!add_content(error_400_form))
-			return false;
+	char* p = append(buf, "Content-Length: ");
+	p = format_uint(p, len);
+	p = append(p, "\r\n");
+	data.append(buf, p - buf);
 
-		break;
+	if (headers)
+		data.append(*headers);
+
+	response->status = status;
+	response->head_len = data.size();
+
+	data.append("\r\n");
+	data.append(body, len);
+}
+
+// 查找不比原文件旧的预压缩兄弟文件
+// 只在原文件加载时探测一次，兄弟文件在原文件之后才出现时，需等原文件失效后才会被使用
+static int probe_precompressed(const file_entry* entry) {
+	static const struct {
+		const char* suffix;
+		int encoding;
+	} siblings[] = {{".br", ENCODING_BR}, {".gz", ENCODING_GZIP}};
+
+	int found = 0;
+	for (size_t i = 0; i < sizeof(siblings) / sizeof(siblings[0]); i++) {
+		std::string path = entry->path + siblings[i].suffix;
+
+		struct stat st;
+		if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+		    (st.st_mode & S_IROTH) && st.st_mtime >= entry->st.st_mtime)
+			found |= siblings[i].encoding;
 	}
-	case NO_RESOURCE: {
-		add_status_line(404, error_404_title);
-		add_headers(strlen(error_404_form));
+	return found;
+}
 
-		if (!add_content(error_404_form))
-			return false;
+// 文件加载时由文件缓存调用
+// 为每个文件生成 ETag、Last-Modified 与 304 应答，为小文件生成完整应答
+// 强 ETag 由 inode、大小与纳秒级修改时间组成，文件被替换或修改后必然不同
+// 压缩的表示在 ETag 后附加编码名，可压缩的文件及其压缩表示的应答均带 Vary
+void http_conn::render_file(file_entry* entry) {
+	const struct stat& st = entry->st;
+
+	// 预压缩文件按去掉编码后缀的原文件名确定类型
+	size_t name_len = entry->path.size();
+	if (entry->encoding && !entry->generated)
+		name_len = entry->path.rfind('.');
+	entry->type = &mime_types::lookup(entry->path.data(), name_len);
+
+	bool compressible = !entry->encoding && entry->type->compressible;
+	if (compressible)
+		entry->precompressed = probe_precompressed(entry);
+
+	char buf[80];
+	int len = snprintf(buf, sizeof(buf), "\"%lx-%lx-%llx%s%s\"",
+	                   (unsigned long)st.st_ino, (unsigned long)st.st_size,
+	                   (unsigned long long)st.st_mtim.tv_sec * 1000000000ULL +
+	                       st.st_mtim.tv_nsec,
+	                   entry->encoding ? "-" : "",
+	                   entry->encoding ? entry->encoding : "");
+	entry->etag.assign(buf, len);
+
+	char date[http_date::DATE_LEN];
+	http_date::format(st.st_mtime, date);
+
+	std::string& validators = entry->validators;
+	validators.assign("ETag: ");
+	validators.append(entry->etag);
+	validators.append("\r\nLast-Modified: ");
+	validators.append(date, sizeof(date));
+	validators.append("\r\n");
+	if (compressible || entry->encoding)
+		validators.append("Vary: Accept-Encoding\r\n");
+
+	// 304 应答没有消息体，也不带 Content-Length
+	const char* line;
+	size_t line_len = format_status_line(buf, 304, &line);
+
+	prerendered& not_modified = entry->not_modified;
+	not_modified.data.assign(line, line_len);
+	not_modified.data.append(validators);
+	not_modified.status = 304;
+	not_modified.head_len = not_modified.data.size();
+	not_modified.data.append("\r\n");
+
+	off_t threshold = m_prerender_threshold.load(std::memory_order_relaxed);
+	if (threshold < 0 || st.st_size > threshold)
+		return;
 
-		break;
+	std::string headers(entry->type->header, entry->type->header_len);
+	headers.append(validators);
+	headers.append(accept_ranges);
+	if (entry->encoding) {
+		headers.append("Content-Encoding: ");
+		headers.append(entry->encoding);
+		headers.append("\r\n");
+	}
+
+	if (st.st_size == 0) {
+		render(&entry->response, 200, NULL, empty_file_form,
+		       strlen(empty_file_form), &headers);
+		return;
+	}
+
+	// 压缩结果在堆上，可直接复制
+	if (entry->generated) {
+		render(&entry->response, 200, NULL, entry->address, st.st_size,
+		       &headers);
+		return;
+	}
+
+	// 以 pread 读取文件内容，文件在此期间被截断时读映射会触发 SIGBUS
+	// 读到的字节不足时不预生成，由 writev 从映射发送
+	std::string body(st.st_size, '\0');
+	size_t done = 0;
+	while (done < body.size()) {
+		ssize_t n = pread(entry->fd, &body[done], body.size() - done, done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		done += n;
+	}
+
+	render(&entry->response, 200, NULL, body.data(), body.size(), &headers);
+}
+
+void http_conn::init_responses() {
+	render(&m_error_pages[BAD_REQUEST], 400, "text/plain",
+	       error_400_form, strlen(error_400_form));
+	render(&m_error_pages[FORBIDDEN_REQUEST], 403, "text/plain",
+	       error_403_form, strlen(error_403_form));
+	render(&m_error_pages[NO_RESOURCE], 404, "text/plain",
+	       error_404_form, strlen(error_404_form));
+	render(&m_error_pages[METHOD_NOT_ALLOWED], 405, "text/plain",
+	       error_405_form, strlen(error_405_form));
+	render(&m_error_pages[REQUEST_TOO_LARGE], 413, "text/plain",
+	       error_413_form, strlen(error_413_form));
+	render(&m_error_pages[EXPECTATION_FAILED], 417, "text/plain",
+	       error_417_form, strlen(error_417_form));
+	render(&m_error_pages[INTERNAL_ERROR], 500, "text/plain",
+	       error_500_form, strlen(error_500_form));
+	render(&m_error_pages[NOT_IMPLEMENTED], 501, "text/plain",
+	       error_501_form, strlen(error_501_form));
+	render(&m_error_pages[VERSION_NOT_SUPPORTED], 505, "text/plain",
+	       error_505_form, strlen(error_505_form));
+
+	file_cache::instance().set_renderer(render_file);
+}
+
+// 追加一段待发送数据，与上一段在内存中相邻时直接合并
+// 发送队列已满时丢弃该段并记下溢出，当前应答已不完整，由 queue_response 撤回
+void http_conn::add_iov(char* base, size_t len) {
+	if (len == 0)
+		return;
+
+	if (m_iv_count > 0) {
+		struct iovec& last = m_iv[m_iv_count - 1];
+
+		if ((char*)last.iov_base + last.iov_len == base) {
+			last.iov_len += len;
+			m_bytes_to_send += len;
+			return;
+		}
+	}
+
+	if (m_iv_count == (int)(sizeof(m_iv) / sizeof(m_iv[0]))) {
+		m_iv_overflow = true;
+		return;
+	}
+
+	m_bytes_to_send += len;
+	m_iv[m_iv_count].iov_base = base;
+	m_iv[m_iv_count].iov_len = len;
+	m_iv_count++;
+}
+
+// 记下当前请求的应答记录，请求随后即被丢弃
+// 采样写入访问日志时复制一份 URL，访问日志与 debug 日志共用采样率
+void http_conn::record_access(int64_t handle_tsc, int64_t bytes) {
+	access_record& rec = m_access[m_access_count++];
+	rec.read_tsc = m_read_tsc;
+	rec.parse_tsc = m_parse_tsc;
+	rec.handle_tsc = handle_tsc;
+	rec.status = m_status;
+	rec.bytes = bytes;
+	rec.url = NULL;
+	rec.url_len = 0;
+
+	if (!fmtlog::checkLogLevel(fmtlog::INF) || !server_log::sample())
+		return;
+
+	rec.url_len = std::min<size_t>(m_url.len, MAX_LOG_URL);
+	char* url = m_log_buf.reserve(rec.url_len);
+	memcpy(url, get_url(), rec.url_len);
+	m_log_buf.commit(rec.url_len);
+	rec.url = url;
+}
+
+// 发送队列全部发出后将其中每个应答计入指标，并为采样到的请求写一条访问日志
+// 访问日志中各阶段耗时以纳秒计：
+// conn 连接建立到读入请求首字节，keep-alive 连接上即为连接已存活的时间
+// parse 读入首字节到解析完成，包含等待请求剩余数据与线程池排队
+// handle 解析完成到处理函数完成
+// wait 处理函数完成到开始发送，包含队列中后续请求的处理与 EPOLLOUT 往返
+// send 开始发送到最后一个字节写入 socket
+void http_conn::report_access() {
+	if (m_access_count == 0)
+		return;
+
+	int64_t done_tsc = server_log::rdtsc();
+	const unsigned char* ip = (const unsigned char*)&m_address.sin_addr;
+
+	for (int i = 0; i < m_access_count; i++) {
+		const access_record& rec = m_access[i];
+
+		metrics::count_status(rec.status);
+		metrics::record(MH_REQUEST_DURATION,
+		                server_log::tsc_to_ns(done_tsc - rec.read_tsc));
+
+		if (!rec.url)
+			continue;
+
+		logi("access {}.{}.{}.{} {} {} {} conn={} parse={} handle={} wait={} "
+		     "send={}",
+		     ip[0], ip[1], ip[2], ip[3], rec.status, rec.bytes,
+		     fmt::string_view(rec.url, rec.url_len),
+		     server_log::tsc_to_ns(rec.read_tsc - m_accept_tsc),
+		     server_log::tsc_to_ns(rec.parse_tsc - rec.read_tsc),
+		     server_log::tsc_to_ns(rec.handle_tsc - rec.parse_tsc),
+		     server_log::tsc_to_ns(m_write_tsc - rec.handle_tsc),
+		     server_log::tsc_to_ns(done_tsc - m_write_tsc));
+	}
+}
+
+// 校验值、Vary 与 Content-Encoding 行
+bool http_conn::add_file_headers(const file_entry* file) {
+	if (!file->validators.empty() &&
+	    !add_bytes(file->validators.data(), file->validators.size()))
+		return false;
+
+	if (file->encoding) {
+		char buf[64];
+		char* p = append(buf, "Content-Encoding: ");
+		p = append(p, file->encoding, strlen(file->encoding));
+		p = append(p, "\r\n");
+		return add_bytes(buf, p - buf);
+	}
+
+	return true;
+}
+
+// 发送文件的 [offset, offset + len)，直接引用映射的内存，不做复制
+// 大段内容使用 sendfile 零拷贝发送，此后不再合并后续应答
+bool http_conn::add_file_body(file_entry* file, off_t offset, off_t len) {
+	off_t threshold = m_sendfile_threshold.load(std::memory_order_relaxed);
+	m_sendfile = threshold >= 0 && file->fd >= 0 && len >= threshold;
+
+	if (m_sendfile) {
+		m_bytes_to_send += len;
+		m_file_offset = offset;
+	} else
+		add_iov(file->address + offset, len);
+
+	return true;
+}
+
+// 分段边界，进程启动时间与计数混合而成，不会出现在文件内容中的概率极高
+static size_t make_boundary(char* buf) {
+	static const uint64_t seed = (uint64_t)time(NULL) * 0x9e3779b97f4a7c15ULL;
+	static std::atomic<uint64_t> counter(0);
+
+	uint64_t v = seed ^ ((counter.fetch_add(1, std::memory_order_relaxed) + 1) *
+	                     0xbf58476d1ce4e5b9ULL);
+
+	static const char digits[] = "0123456789abcdef";
+	for (int i = 0; i < 16; i++)
+		buf[i] = digits[(v >> (60 - i * 4)) & 0xf];
+	return 16;
+}
+
+// 写出 "first-last/size"
+static char* format_content_range(char* p, off_t start, off_t end, off_t size) {
+	p = format_uint(p, start);
+	*p++ = '-';
+	p = format_uint(p, end - 1);
+	*p++ = '/';
+	return format_uint(p, size);
+}
+
+// 206 应答，区间已由 parse_range 排序合并
+// 单个区间直接发送该段内容，多个区间以 multipart/byteranges 发送，
+// 每段的分段头写入写缓冲区，内容引用映射的内存，不使用 sendfile
+bool http_conn::add_ranges(file_entry* file) {
+	off_t size = file->st.st_size;
+	const mime_type* type = file->type;
+
+	if (!add_status_line(206) || !add_file_headers(file))
+		return false;
+
+	char buf[320];
+
+	if (m_range_count == 1) {
+		const byte_range& r = m_ranges[0];
+
+		char* p = append(buf, "Content-Range: bytes ");
+		p = format_content_range(p, r.start, r.end, size);
+		p = append(p, "\r\n");
+
+		return add_bytes(type->header, type->header_len) &&
+		       add_bytes(buf, p - buf) && add_headers(r.end - r.start) &&
+		       add_file_body(file, r.start, r.end - r.start);
+	}
+
+	char boundary[16];
+	size_t boundary_len = make_boundary(boundary);
+
+	// 分段头为 "\r\n--boundary\r\nContent-Type: ...\r\n"
+	// "Content-Range: bytes first-last/size\r\n\r\n"，先算出消息体总长度
+	size_t total = 0;
+	for (int i = 0; i < m_range_count; i++) {
+		const byte_range& r = m_ranges[i];
+		char* p = format_content_range(buf, r.start, r.end, size);
+		total += sizeof("\r\n--\r\nContent-Range: bytes \r\n\r\n") - 1 +
+		         boundary_len + type->header_len + (p - buf) +
+		         (r.end - r.start);
 	}
-	case FORBIDDEN_REQUEST: {
-		add_status_line(403, error_403_title);
-		add_headers(strlen(error_403_form));
+	total += sizeof("\r\n----\r\n") - 1 + boundary_len;
+
+	char* p = append(buf, "multipart/byteranges; boundary=");
+	p = append(p, boundary, boundary_len);
+	*p = '\0';
+	if (!add_headers(total, buf))
+		return false;
 
-		if (!add_content(error_403_form))
+	for (int i = 0; i < m_range_count; i++) {
+		const byte_range& r = m_ranges[i];
+
+		p = append(buf, "\r\n--");
+		p = append(p, boundary, boundary_len);
+		p = append(p, "\r\n");
+		p = append(p, type->header, type->header_len);
+		p = append(p, "Content-Range: bytes ");
+		p = format_content_range(p, r.start, r.end, size);
+		p = append(p, "\r\n\r\n");
+		if (!add_bytes(buf, p - buf))
 			return false;
 
-		break;
+		add_iov(file->address + r.start, r.end - r.start);
 	}
+
+	p = append(buf, "\r\n--");
+	p = append(p, boundary, boundary_len);
+	p = append(p, "--\r\n");
+	return add_bytes(buf, p - buf);
+}
+
+// 目标文件交由发送队列持有，发送完毕后归还
+file_entry* http_conn::queue_file() {
+	file_entry* file = m_file;
+	m_send_files[m_send_file_count++] = file;
+	m_file = 0;
+	m_file_address = 0;
+	m_file_stat = 0;
+	return file;
+}
+
+// 根据服务器处理 HTTP 请求结果，决定返回客户端内容
+// 应答追加在发送队列末尾，HEAD 请求的应答与 GET 相同但不发送消息体
+bool http_conn::process_write(HTTP_CODE ret) {
+	bool body = m_method != HEAD;
+
+	switch (ret) {
+	case INTERNAL_ERROR:
+	case BAD_REQUEST:
+	case NO_RESOURCE:
+	case FORBIDDEN_REQUEST:
+	case METHOD_NOT_ALLOWED:
+	case REQUEST_TOO_LARGE:
+	case EXPECTATION_FAILED:
+	case NOT_IMPLEMENTED:
+	case VERSION_NOT_SUPPORTED:
+		return add_prerendered(m_error_pages[ret], body);
+
+	case NOT_MODIFIED:
+		return add_prerendered(queue_file()->not_modified);
+
+	case PARTIAL_CONTENT:
+		return add_ranges(queue_file());
+
+	case RANGE_NOT_SATISFIABLE: {
+		file_entry* file = queue_file();
+
+		char buf[64];
+		char* p = append(buf, "Content-Range: bytes */");
+		p = format_uint(p, file->st.st_size);
+		p = append(p, "\r\n");
+
+		return add_status_line(416) && add_bytes(buf, p - buf) &&
+		       add_headers(strlen(error_416_form), "text/plain") &&
+		       add_content(error_416_form);
+	}
+
 	case FILE_REQUEST: {
-		add_status_line(200, ok_200_title);
+		file_entry* file = queue_file();
+
+		// 小文件的应答已在加载时生成
+		if (!file->response.data.empty())
+			return add_prerendered(file->response, body);
+
+		if (!add_status_line(200) ||
+		    !add_bytes(file->type->header, file->type->header_len) ||
+		    !add_file_headers(file) ||
+		    !add_bytes(accept_ranges, sizeof(accept_ranges) - 1))
+			return false;
 
 		// 文件有内容情况
-		if (m_file_stat.st_size != 0) {
-			add_headers(m_file_stat.st_size);
-			m_iv[0].iov_base = m_write_buf;
-			m_iv[0].iov_len = m_write_idx;
-			m_iv[1].iov_base = m_file_address;
-			m_iv[1].iov_len = m_file_stat.st_size;
-			m_iv_count = 2;
+		if (file->st.st_size != 0) {
+			if (!add_headers(file->st.st_size))
+				return false;
+			if (body)
+				return add_file_body(file, 0, file->st.st_size);
 			return true;
 		}
 
 		// 文件没有内容情况
 		else {
-			const char* ok_string = "<html><body></body></html>";
-			add_headers(strlen(ok_string));
+			if (!add_headers(strlen(empty_file_form)))
+				return false;
 
-			if (!add_content(ok_string))
+			if (body && !add_content(empty_file_form))
 				return false;
 		}
+
+		break;
+	}
+	case CONTENT_REQUEST: {
+		if (!add_status_line(200) || !add_headers(m_content_len, m_content_type))
+			return false;
+		if (body)
+			add_iov((char*)m_content, m_content_len);
+		break;
 	}
 	default:
 		return false;
 	}
 
-	m_iv[0].iov_base = m_write_buf;
-	m_iv[0].iov_len = m_write_idx;
-	m_iv_count = 1;
 	return true;
 }
 
-// 线程池中工作线程调用程序，即HTTP请求处理入口函数
-void http_conn::process() {
-	HTTP_CODE read_ret = process_read();
+// 生成当前请求的应答并加入发送队列，随后丢弃该请求并将剩余的流水线数据移到读缓冲区头部
+// 返回 false 表示不再处理后续请求，队列发送完毕后关闭连接
+bool http_conn::queue_response(HTTP_CODE ret) {
+	int64_t handle_tsc = server_log::rdtsc();
+	int64_t queued = m_bytes_to_send;
+	int iv_count = m_iv_count;
+	size_t last_len = iv_count > 0 ? m_iv[iv_count - 1].iov_len : 0;
+
+	// 服务器正在停止，应答后关闭连接
+	if (m_draining.load(std::memory_order_relaxed))
+		m_linger = false;
+
+	bool ok = process_write(ret);
+
+	// 应答所需的 iovec 段数超出发送队列容量，或生成到一半失败，
+	// 撤回已加入的部分，避免发出不完整的头部，改为 500 后关闭连接
+	// 撤回后剩余空间至少为 MAX_RESPONSE_IOV + 1 段，足以容纳预先生成的错误页
+	if (m_iv_overflow || !ok) {
+		if (m_iv_overflow)
+			logwl(1000000000, "response needs more than {} iovecs, sending 500",
+			      sizeof(m_iv) / sizeof(m_iv[0]));
+		else
+			logwl(1000000000, "failed to build response {}, sending 500",
+			      (int)ret);
+		m_iv_overflow = false;
+		m_iv_count = iv_count;
+		if (iv_count > 0)
+			m_iv[iv_count - 1].iov_len = last_len;
+		m_bytes_to_send = queued;
+		m_sendfile = false;
+		m_linger = false;
+		ok = add_prerendered(m_error_pages[INTERNAL_ERROR], m_method != HEAD);
+	}
 
-	if (read_ret == NO_REQUEST) {
-		modfd(m_epollfd, m_sockfd, EPOLLIN);
-		return;
+	if (!ok) {
+		m_close_after_send = true;
+		return false;
 	}
 
-	bool write_ret = process_write(read_ret);
+	record_access(handle_tsc, m_bytes_to_send - queued);
+	m_pipeline_count++;
 
-	if (!write_ret) {
-		close_conn();
+	if (!m_linger) {
+		m_close_after_send = true;
+		return false;
 	}
 
-	modfd(m_epollfd, m_sockfd, EPOLLOUT);
+	init_request();
+	return true;
+}
+
+// 依次解析读缓冲区中的请求并生成应答，直到请求不完整、发送队列已满或连接不再保持
+// 一个请求处理完后立即解析缓冲区中剩余的流水线请求，应答在队列中合并后一次发送
+// inline_mode 为真时遇到阻塞处理函数即返回 true，由调用者交给线程池
+bool http_conn::process_requests(bool inline_mode) {
+	m_pipelined = false;
+	m_on_reactor = inline_mode;
+
+	while (true) {
+		HTTP_CODE read_ret = process_read();
+
+		if (read_ret == NO_REQUEST) {
+			// 请求尚不完整，等待后续数据
+			if (m_read_buf.size() < (size_t)m_max_read_size)
+				return false;
+
+			// 单个请求超出读缓冲区大小
+			read_ret = BAD_REQUEST;
+		}
+
+		if (read_ret == BAD_REQUEST)
+			metrics::add(MC_PARSE_ERRORS);
+
+		m_parse_tsc = server_log::rdtsc();
+
+		if (read_ret == GET_REQUEST) {
+			if (inline_mode && m_handler->blocking)
+				return true;
+
+			read_ret = do_handler();
+		} else {
+			// 请求无法解析或消息体未读完时无法确定下一个请求的起点，应答后关闭连接
+			m_linger = false;
+		}
+
+		if (!queue_response(read_ret))
+			return false;
+
+		// 发送队列已满，剩余请求在队列发送完毕后继续处理
+		if (m_sendfile || m_pipeline_count >= MAX_PIPELINE ||
+		    m_iv_count > MAX_PIPELINE * 3)
+			return false;
+	}
+}
+
+// 填充应答并注册 EPOLLOUT 事件，由 reactor 线程完成发送
+// 填充失败时不在工作线程关闭连接，由 reactor 线程在 write 中发送完已有应答后关闭
+void http_conn::finish_process(HTTP_CODE ret) {
+	queue_response(ret);
+	modfd(m_backend, m_sockfd, m_handle, EPOLLOUT);
+}
+
+// 线程池中工作线程调用程序，即HTTP请求处理入口函数
+void http_conn::process() {
+	process_requests(false);
+
+	// 没有应答但可能有待发送的 100 Continue
+	if (m_bytes_to_send == 0 && !m_close_after_send)
+		modfd(m_backend, m_sockfd, m_handle, EPOLLIN);
+	else
+		modfd(m_backend, m_sockfd, m_handle, EPOLLOUT);
+
+	// 重新注册事件后才结束占用，此后连接只由 reactor 线程访问
+	m_busy.fetch_sub(1, std::memory_order_release);
+}
+
+// run-to-completion 模式下 reactor 线程调用
+// 解析请求并在本线程内生成应答、直接发送，省去线程池投递与 EPOLLOUT 往返
+// 应答一次发送完毕且缓冲区中仍有流水线请求时继续处理
+// 返回 true 表示匹配到阻塞处理函数，需由调用者将 process_handler 交给线程池
+bool http_conn::process_inline() {
+	do {
+		if (process_requests(true))
+			return true;
+
+		if (m_bytes_to_send == 0 && !m_close_after_send) {
+			modfd(m_backend, m_sockfd, m_handle, EPOLLIN);
+			return false;
+		}
+
+		if (!write()) {
+			close_conn();
+			return false;
+		}
+	} while (m_pipelined);
+
+	return false;
+}
+
+// 线程池中执行阻塞处理函数
+void http_conn::process_handler() {
+	m_on_reactor = false;
+	finish_process(do_handler());
+	m_busy.fetch_sub(1, std::memory_order_release);
 }
@@ -1,11 +1,18 @@
 #ifndef HTTPCONNECTION_H
 #define HTTPCONNECTION_H
 
+#include "chain_buffer.h"
+#include "file_cache.h"
+#include "http_parser.h"
+#include "io_backend.h"
 #include "locker.h"
+#include "timer_wheel.h"
 #include <arpa/inet.h>
 #include <assert.h>
+#include <atomic>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
@@ -15,19 +22,30 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/signal.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <string>
 #include <unistd.h>
+#include <vector>
 
 class http_conn {
 public:
-	static const int FILENAME_LEN = 200;       // 文件名最大长度
-	static const int READ_BUFFER_SIZE = 2048;  // 读缓冲区的大小
-	static const int WRITE_BUFFER_SIZE = 1024; // 写缓冲区的大小
+	static const int DEFAULT_MAX_READ_SIZE = 64 * 1024; // 读缓冲区默认最多缓存的未处理数据
+	static const int MAX_PIPELINE = 16;        // 一次合并发送的最大应答数
+	static const int MAX_HEADERS = 64;         // 单个请求最多的头部字段数
+	static const int MAX_LOG_URL = 256;        // 访问日志中 URL 的最大长度
+	static const int MAX_CHUNK_LINE = 1024;    // chunked 消息体中块大小行与尾部字段行的最大长度
+	static const int MAX_RANGES = 16;          // Range 中最多的区间数，超出时忽略 Range 发送整个文件
+	static const int MAX_RESPONSE_IOV = MAX_RANGES * 2 + 4; // 单个应答最多占用的 iovec 段数
+	static const off_t DEFAULT_SENDFILE_THRESHOLD = 64 * 1024; // 使用 sendfile 的最小文件大小
+	static const off_t DEFAULT_PRERENDER_THRESHOLD = 16 * 1024; // 预先生成完整应答的最大文件大小
+	static const off_t DEFAULT_COMPRESS_MIN_SIZE = 256;         // 即时压缩的最小文件大小
+	static const off_t DEFAULT_COMPRESS_MAX_SIZE = 1024 * 1024; // 即时压缩的最大文件大小
 
-	// HTTP请求方法，此处仅实现对于 GET 的支持
+	// HTTP请求方法，此处实现了 GET、HEAD、POST 与 PUT
 	enum METHOD {
 		GET = 0,
 		POST,
@@ -41,10 +59,16 @@ public:
 	};
 
 	// HTTP请求时主机所处状态
+	// 前两个状态增量查找请求头结束的空行，找到后一次解析全部行
+	// 之后的状态依次读取消息体，CONTENT 读取 Content-Length 消息体或 chunked 的一个块的数据
 	enum CHECK_STATE {
 		CHECK_STATE_REQUESTLINE = 0,
 		CHECK_STATE_HEADER,
 		CHECK_STATE_CONTENT,
+		CHECK_STATE_CHUNK_SIZE,    // 块大小行
+		CHECK_STATE_CHUNK_END,     // 块数据之后的 \r\n
+		CHECK_STATE_TRAILER,       // 最后一个块之后的尾部字段
+		CHECK_STATE_DONE,          // 消息体已读完
 	};
 	// 服务器处理 HTTP 请求的结果
 	// NO_REQUEST 请求不完整，需要继续读取客户端
@@ -53,7 +77,16 @@ public:
 	// NO_RESOURCE 服务端无该资源可用
 	// FORBIDDEN_REQUEST 客户对资源没有足够访问权限
 	// FILE_REQUEST 文件资源请求
+	// CONTENT_REQUEST 处理函数已通过 set_content 生成应答消息体
+	// NOT_MODIFIED 条件请求的文件未变化，应答 304
+	// PARTIAL_CONTENT 文件的一个或多个区间，应答 206
+	// RANGE_NOT_SATISFIABLE Range 中没有可满足的区间，应答 416
+	// METHOD_NOT_ALLOWED 处理函数不接受该请求方法
+	// REQUEST_TOO_LARGE 消息体超出上限
+	// EXPECTATION_FAILED 不支持的 Expect
 	// INTERNAL_ERROR 服务器内部错误
+	// NOT_IMPLEMENTED 不支持的请求方法或传输编码
+	// VERSION_NOT_SUPPORTED 不支持的 HTTP 版本
 	// CLOSED_CONNECTION 客户端连接已关闭
 	enum HTTP_CODE {
 		NO_REQUEST,
@@ -62,7 +95,16 @@ public:
 		NO_RESOURCE,
 		FORBIDDEN_REQUEST,
 		FILE_REQUEST,
+		CONTENT_REQUEST,
+		NOT_MODIFIED,
+		PARTIAL_CONTENT,
+		RANGE_NOT_SATISFIABLE,
+		METHOD_NOT_ALLOWED,
+		REQUEST_TOO_LARGE,
+		EXPECTATION_FAILED,
 		INTERNAL_ERROR,
+		NOT_IMPLEMENTED,
+		VERSION_NOT_SUPPORTED,
 		CLOSED_CONNECTION
 	};
 
@@ -70,79 +112,367 @@ public:
 	// 读到一个完整行，行出错，行数据尚不完整
 	enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
 
+	// 连接所处阶段，reactor 据此选择超时时间
+	enum CONN_PHASE { PHASE_IDLE = 0, PHASE_READING, PHASE_BODY, PHASE_WRITING };
+
+	// 当前定时器类型
+	// 读取请求头、keep-alive 空闲、消息体接收停滞、发送停滞
+	enum TIMER_KIND {
+		TIMER_NONE = 0,
+		TIMER_HEADER,
+		TIMER_IDLE,
+		TIMER_BODY,
+		TIMER_WRITE
+	};
+
+	// 请求处理函数，按 URL 前缀匹配
+	// blocking 为真表示处理函数可能阻塞，run-to-completion 模式下也交由线程池执行
+	// methods 为接受的请求方法，以 1 << METHOD 组成，其余方法在读取消息体之前即被拒绝
+	// 接受 GET 的处理函数同样接受 HEAD，应答时去掉消息体
+	//
+	// 消息体读入后按到达顺序交给 on_body，处理完的数据随即从读缓冲区丢弃，
+	// 上传的大小不受读缓冲区限制；on_body 返回 NO_REQUEST 继续接收，返回其他值时
+	// 以该结果应答并关闭连接。消息体全部交付后调用 func 生成应答
+	// on_body 在解析请求的线程中调用，run-to-completion 模式下即 reactor 线程，不应阻塞
+	// on_body 为 NULL 时消息体缓存在连接中，不超过单个请求的大小上限，func 经 get_body 读取
+	typedef HTTP_CODE (*handler_func)(http_conn* conn);
+	typedef HTTP_CODE (*body_func)(http_conn* conn, const char* data, size_t len);
+	struct handler {
+		const char* prefix;
+		size_t prefix_len;
+		handler_func func;
+		bool blocking;
+		unsigned methods;
+		body_func on_body;
+	};
+
 public:
 	http_conn() {}
 	~http_conn() {}
 
 public:
-	void init(int sockfd, const sockaddr_in& addr); // 初始化新接受的连接
+	void init(int sockfd, const sockaddr_in& addr, io_backend* backend,
+	          uint64_t handle);               // 初始化新接受的连接
 	void close_conn(bool real_close = true);        // 关闭连接
 	void process();                                 // 处理客户请求
+	bool process_inline();                          // 在 reactor 线程内处理请求
+	void process_handler();                         // 线程池中执行阻塞处理函数
 	bool read();                                    // 非阻塞读操作
 	bool write();                                   // 非阻塞写操作
 
+	// 完成模式下由 I/O 后端收发数据
+	// read 追加后端已收取的数据；send_done 处理 write 提交的发送的完成事件，
+	// 返回值与 write 相同；cancel_send 取消进行中的发送，其完成事件到达后连接才可关闭
+	void read(const char* data, size_t len);
+	bool send_done(int res);
+	void cancel_send();
+	bool is_sending() const { return m_sending; }
+
+	// 连接对象池分配的句柄，注册事件时随 fd 传给 I/O 后端
+	uint64_t get_handle() const { return m_handle; }
+
+	// 应答发送完毕后读缓冲区中仍有流水线请求，需由调用者立即解析
+	bool has_pipelined() const { return m_pipelined; }
+
+	// 注册请求处理函数，需在 reactor 启动前调用
+	static void register_handler(const char* prefix, handler_func func,
+	                             bool blocking, unsigned methods = 1 << GET,
+	                             body_func on_body = NULL);
+
+	// 请求的 URL，位于读缓冲区中且不以 '\0' 结尾
+	// 已解码并规范化的请求路径，不含查询串
+	const char* get_url() const { return m_read_data + m_url.off; }
+	size_t get_url_len() const { return m_url.len; }
+
+	// '?' 之后的查询串，未解码
+	const char* get_query() const { return m_read_data + m_query.off; }
+	size_t get_query_len() const { return m_query.len; }
+
+	METHOD get_method() const { return m_method; }
+
+	// 请求的 HTTP 次版本号，HTTP/1.0 为 0，HTTP/1.1 为 1
+	int get_version() const { return m_version; }
+
+	// 消息体尚未读完时还需读取的字节数，chunked 消息体为当前块的剩余字节数
+	size_t need_bytes() const { return m_body_need; }
+
+	// 已交付的消息体字节数，chunked 消息体为解码后的字节数
+	size_t body_received() const { return m_body_received; }
+
+	// 缓存的完整消息体，处理函数未注册 on_body 时有效，没有消息体时 len 为 0
+	const char* get_body(size_t* len);
+
+	// 查找指定头部字段，不存在时返回 NULL
+	const http_header* find_header(HTTP_HEADER id) const;
+	const char* get_span(const http_span& span) const { return m_read_data + span.off; }
+
+	// 处理函数生成的应答消息体，复制到写缓冲区中，处理函数随后返回 CONTENT_REQUEST
+	// content_type 需在应答发送完毕前保持有效
+	void set_content(const char* data, size_t len, const char* content_type);
+
+	// 以 Prometheus 文本格式输出服务器指标的处理函数
+	static HTTP_CODE serve_metrics(http_conn* conn);
+
+	// 接收并丢弃上传的消息体，应答收到的字节数，用于测试上传吞吐
+	static HTTP_CODE serve_upload(http_conn* conn);
+	static HTTP_CODE discard_body(http_conn* conn, const char* data, size_t len);
+
+	CONN_PHASE get_phase() const {
+		if (m_bytes_to_send > 0)
+			return PHASE_WRITING;
+		if (m_check_state >= CHECK_STATE_CONTENT)
+			return PHASE_BODY;
+		return m_read_buf.empty() ? PHASE_IDLE : PHASE_READING;
+	}
+
+	// 不小于该大小的文件使用 sendfile 发送，为负数时关闭 sendfile
+	// 可在运行中由其他线程修改
+	static void set_sendfile_threshold(off_t bytes) {
+		m_sendfile_threshold.store(bytes, std::memory_order_relaxed);
+	}
+
+	// 不大于该大小的文件在加载时生成完整应答，为负数时关闭
+	// 可在运行中修改，只影响此后加载的文件
+	static void set_prerender_threshold(off_t bytes) {
+		m_prerender_threshold.store(bytes, std::memory_order_relaxed);
+	}
+
+	// 是否使用预压缩的 .br 与 .gz 兄弟文件，以及即时 gzip 压缩的文件大小范围
+	// 线程池处理请求时在该线程中压缩；reactor 线程处理时交给线程池压缩，本次先发送未压缩的内容
+	// max_size 限制单次压缩的耗时，为 0 时关闭即时压缩
+	// 可在运行中由其他线程修改
+	static void set_compression(bool precompressed, off_t min_size,
+	                            off_t max_size) {
+		m_precompressed.store(precompressed, std::memory_order_relaxed);
+		m_compress_min_size.store(min_size, std::memory_order_relaxed);
+		m_compress_max_size.store(max_size, std::memory_order_relaxed);
+	}
+
+	// 服务器停止时置位，此后的应答均不再保持连接
+	static void set_draining(bool draining) {
+		m_draining.store(draining, std::memory_order_relaxed);
+	}
+
+	// 网站根目录与单个请求的大小上限，需在 reactor 启动前设置
+	static bool set_doc_root(const char* path);
+	static void set_max_read_size(int bytes) { m_max_read_size = bytes; }
+
+	// 生成错误页应答并向文件缓存注册小文件渲染函数，需在 reactor 启动前调用
+	static void init_responses();
+
 private:
 	void init();                       // 初始化连接
+	void init_request();               // 丢弃已处理的请求，准备解析下一个请求
+	void init_response();              // 清空已发送完毕的应答队列
 	HTTP_CODE process_read();          // 解析 HTTP请求
 	bool process_write(HTTP_CODE ret); // 填充 HTTP应答
+	bool process_requests(bool inline_mode); // 依次处理读缓冲区中的请求
+	bool queue_response(HTTP_CODE ret); // 将当前请求的应答加入发送队列
 
 	// process_read 调用以下函数分析 HTTP 请求
-	HTTP_CODE parse_request_line(char* text);
-	HTTP_CODE parse_headers(char* test);
-	HTTP_CODE parse_content(char* test);
+	HTTP_CODE parse_request_line(http_span line);
+	HTTP_CODE parse_headers(http_span line);
+	HTTP_CODE parse_header_block();
+	HTTP_CODE check_request();
+	HTTP_CODE parse_content();
+	HTTP_CODE parse_chunk_size();
+	HTTP_CODE parse_trailer();
+	HTTP_CODE deliver_body(size_t len);
+	int find_body_line();
 	HTTP_CODE do_request();
-	char* get_line() { return m_read_buf + m_start_line; }
-	LINE_STATUS parse_line();
+	bool not_modified() const;
+	void select_encoding();
+	bool if_range_matches() const;
+	HTTP_CODE parse_range();
+	HTTP_CODE do_handler();
+	void finish_process(HTTP_CODE ret);
+	const handler* match_handler() const;
+	static HTTP_CODE serve_static(http_conn* conn);
+	LINE_STATUS scan_header();
+	void update_read_view();
 
 	// process_write 调用以下函数以填充 HTTP 问答
 	void unmap();
-	bool add_response(const char* format, ...);
+	bool add_bytes(const char* data, size_t len);
 	bool add_content(const char* content);
-	bool add_status_line(int status, const char* title);
-	bool add_headers(int content_length);
-	bool add_content_length(int content_length);
+	bool add_status_line(int status);
+	bool add_headers(size_t content_length, const char* content_type = NULL);
+	bool add_prerendered(const prerendered& response, bool body = true);
+	bool add_file_headers(const file_entry* file);
+	bool add_file_body(file_entry* file, off_t offset, off_t len);
+	bool add_ranges(file_entry* file);
+	file_entry* queue_file();
+	char* put_common_headers(char* p) const;
+	void add_iov(char* base, size_t len);
+
+	void record_access(int64_t handle_tsc, int64_t bytes);
+	void report_access();
 
-	bool add_linger();
-	bool add_blank_line();
+	// write 与 send_done 调用
+	bool submit_send();
+	void consume(ssize_t bytes, bool use_iov);
+	bool finish_send();
+
+	static void render(prerendered* response, int status,
+	                   const char* content_type, const char* body, size_t len,
+	                   const std::string* headers = NULL);
+	static void render_file(file_entry* entry);
 
 public:
-	// 所有 socket 上事件注册到同一个 epoll 内核事件表
-	// 将 epoll 文件描述符设置为静态的
-	static int m_epollfd;
+	// 统计用户数量，多个 reactor 线程并发修改
+	static std::atomic<int> m_user_count;
+
+private:
+	// 已注册的请求处理函数，未匹配时按静态文件处理
+	static std::vector<handler> m_handlers;
+	static const handler m_static_handler;
 
-	// 统计用户数量
-	static int m_user_count;
+	static std::atomic<off_t> m_sendfile_threshold;
+	static std::atomic<off_t> m_prerender_threshold;
+	static std::atomic<bool> m_precompressed;
+	static std::atomic<off_t> m_compress_min_size;
+	static std::atomic<off_t> m_compress_max_size;
+	static std::atomic<bool> m_draining;
+
+	static int m_max_read_size;    // 读缓冲区最多缓存的未处理数据
+
+	// 错误页应答，按 HTTP_CODE 索引
+	static prerendered m_error_pages[CLOSED_CONNECTION + 1];
 
 private:
+	// 超时定时器及其占用状态只由所属 reactor 管理
+	friend class reactor;
+
+	// 连接所属 reactor 的 I/O 后端
+	io_backend* m_backend;
+	uint64_t m_handle;
+
 	// HTTP连接 socket 和对方 socket 地址
 	int m_sockfd;
 	sockaddr_in m_address;
 
-	char m_read_buf[READ_BUFFER_SIZE];      // 读缓冲区
-	int m_read_idx;         // 标识读缓冲区已读入客户数据的最后一个字节的下一个位置
-	int m_checked_idx;      // 当前正在分析字符在读缓冲区内的位置
-	int m_start_line;       // 当前正在解析的行起始位置
+	// 读缓冲区，当前请求从第一个内存块的起始位置开始
+	// 请求头完整后才按行解析，需位于连续内存中，跨越内存块时合并一次
+	chain_buffer m_read_buf;
+	char* m_read_data;      // 第一个内存块中的连续数据
+	int m_read_idx;         // 连续数据的长度
+
+	// 解析器保存的状态，请求不完整时原样保留，下次读入数据后从断点继续
+	int m_checked_idx;      // 下一个待检查字节相对请求起始的位置
+	int m_start_line;       // 当前行的起始位置
+	bool m_scan_cr;         // 上一个检查的字节为行尾的 \r
+	int m_line_ends[MAX_HEADERS + 1];   // 已找到的各行行尾位置，不含 \r\n
+	int m_line_count;
+
+	// 有消息体的请求在请求头解析完后将其复制到 m_head_buf，m_read_data 随之指向副本
+	// 读缓冲区中此后只有消息体与后续请求，消息体交付后即丢弃
+	chain_buffer m_head_buf;
+	chain_buffer m_body_buf;    // 未注册 on_body 时缓存的消息体
+	size_t m_body_need;     // 消息体或当前块还需读取的字节数
+	size_t m_body_received; // 已交付的消息体字节数
+	int m_trailer_count;    // 已跳过的尾部字段行数
 
-	char m_write_buf[WRITE_BUFFER_SIZE];    // 写缓冲区
-	int m_write_idx;        // 写缓冲区中待发送字节数
+	chain_buffer m_write_buf;   // 写缓冲区，依次存放队列中各应答的头部
+	int m_pipeline_count;   // 发送队列中的应答数
+	bool m_close_after_send;    // 发送队列发送完毕后关闭连接
+	bool m_pipelined;       // 读缓冲区中有待解析的流水线请求
+	bool m_on_reactor;      // 当前在 reactor 线程中处理请求，不做耗时的即时压缩
 
 	CHECK_STATE m_check_state;  // 主状态机状态
 	METHOD m_method;        // 请求方法
+	int m_version;          // HTTP 次版本号
 
-	char m_real_file[FILENAME_LEN];     // 客户请求文件路径
-	char* m_url;        // 客户请求文件文件名
+	http_span m_url;    // 规范化后的请求路径，在读缓冲区中原处解码
+	http_span m_query;  // 查询串
 
-	char* m_version;    // HTTP 协议版本号，此处支持 HTTP/1.1
-	char* m_host;       // 主机名
-	int m_content_length;   // HTTP请求消息的长度
+	// 请求的文件区间，按起点排序且互不重叠，[start, end)
+	struct byte_range {
+		off_t start;
+		off_t end;
+	};
+	byte_range m_ranges[MAX_RANGES];
+	int m_range_count;
+
+	http_span m_host;   // 主机名
+	http_header m_headers[MAX_HEADERS]; // 全部头部字段，指向读缓冲区
+	int m_header_count;
+	uint64_t m_content_length;  // HTTP请求消息的长度
+	bool m_has_content_length;
+	bool m_chunked;     // 消息体使用 chunked 传输编码
+	bool m_conn_close;      // Connection 中含 close
+	bool m_conn_keep_alive; // Connection 中含 keep-alive
 	bool m_linger;      // HTTP请求是否要求保持连接
+	const handler* m_handler;   // 匹配到的请求处理函数
 
+	file_entry* m_file;     // 从文件缓存借用的目标文件
 	char* m_file_address;   // 客户端请求目标文件 mmap 到内存的起始位置
-	struct stat m_file_stat;    // 目标文件状态
+	const struct stat* m_file_stat; // 目标文件状态
+
+	// 发送队列中各应答借用的文件，发送完毕后归还
+	file_entry* m_send_files[MAX_PIPELINE];
+	int m_send_file_count;
 
-	// writev 执行写操作
-	struct iovec m_iv[2];
+	// writev 执行写操作，队列中的应答合并为一次 writev
+	// m_iv_idx 为第一个尚未发送完的 iovec
+	// 通常每个应答至多占用三段：跨越内存块的头部两段与文件内容一段
+	// 或预先生成应答的固定头部、Date 与 Connection 行、消息体三段
+	// 多区间应答每个区间另需分隔头部与文件内容两段，结尾分隔行一段
+	// 已用段数超过 MAX_PIPELINE * 3 后不再合并后续应答，剩余空间总能容纳一个应答与 100 Continue
+	// 头部跨越多个内存块等情况仍可能超出估计，add_iov 不越界写入，记下溢出由 queue_response 撤回该应答
+	struct iovec m_iv[MAX_PIPELINE * 3 + MAX_RESPONSE_IOV + 1];
 	int m_iv_count;
+	bool m_iv_overflow;
+	int m_iv_idx;
+	int64_t m_bytes_to_send;    // 剩余待发送字节数
+	int64_t m_bytes_have_send;  // 已发送字节数
+
+	// 完成模式：连接由 I/O 后端收发，发送队列以 m_msg 交给后端，完成前 m_iv 与所引用的内存保持不变
+	// 发送进行中不关闭连接，需先取消并等待完成事件
+	bool m_stream;
+	bool m_sending;
+	bool m_send_canceled;
+	bool m_recv_after; // 发送完毕后后端接着接收，不再注册读事件
+	struct msghdr m_msg;
+
+	// sendfile 执行写操作，只用于队列中最后一个应答的文件或其中一个区间
+	// m_file_offset 记录下次发送的文件偏移
+	bool m_sendfile;
+	off_t m_file_offset;
+
+	// 应答记录，时间均为 rdtsc 读数
+	// 请求的应答入队时记下各阶段时间，发送队列全部发出后计入指标，采样到的写入访问日志
+	struct access_record {
+		int64_t read_tsc;   // 读入请求首字节
+		int64_t parse_tsc;  // 请求解析完成
+		int64_t handle_tsc; // 处理函数完成
+		const char* url;    // 复制在 m_log_buf 中，不写访问日志时为 NULL
+		int url_len;
+		int status;
+		int64_t bytes;      // 应答字节数
+	};
+
+	int64_t m_accept_tsc;    // 接受连接
+	int64_t m_last_read_tsc; // 最近一次读入数据
+	int64_t m_read_tsc;      // 当前请求首字节读入，流水线请求取其所在的读入
+	int64_t m_parse_tsc;     // 当前请求解析完成
+	int64_t m_write_tsc;     // 发送队列首次写出数据
+	int m_status;            // 当前应答的状态码
+
+	access_record m_access[MAX_PIPELINE];
+	int m_access_count;
+	chain_buffer m_log_buf;  // 访问日志记录引用的 URL 副本
+
+	// 处理函数生成的消息体，位于写缓冲区中
+	const char* m_content;
+	size_t m_content_len;
+	const char* m_content_type;
+
+	// 超时定时器，挂在所属 reactor 的时间轮上
+	timer_node m_timer;
+	TIMER_KIND m_timer_kind;
+
+	// 正在线程池中处理的任务数，大于 0 时定时器到期也不关闭连接
+	std::atomic<int> m_busy;
 
 };
 
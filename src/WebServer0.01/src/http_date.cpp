@@ -0,0 +1,123 @@
+#include "http_date.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static const char week_names[7][4] = {"Sun", "Mon", "Tue", "Wed",
+                                      "Thu", "Fri", "Sat"};
+static const char month_names[12][4] = {"Jan", "Feb", "Mar", "Apr",
+                                        "May", "Jun", "Jul", "Aug",
+                                        "Sep", "Oct", "Nov", "Dec"};
+
+static char* put2(char* p, int v) {
+	p[0] = '0' + v / 10;
+	p[1] = '0' + v % 10;
+	return p + 2;
+}
+
+void http_date::format(time_t t, char* buf) {
+	struct tm tm;
+	gmtime_r(&t, &tm);
+
+	char* p = buf;
+	memcpy(p, week_names[tm.tm_wday], 3);
+	p += 3;
+	*p++ = ',';
+	*p++ = ' ';
+	p = put2(p, tm.tm_mday);
+	*p++ = ' ';
+	memcpy(p, month_names[tm.tm_mon], 3);
+	p += 3;
+	*p++ = ' ';
+
+	int year = tm.tm_year + 1900;
+	p = put2(p, year / 100);
+	p = put2(p, year % 100);
+	*p++ = ' ';
+	p = put2(p, tm.tm_hour);
+	*p++ = ':';
+	p = put2(p, tm.tm_min);
+	*p++ = ':';
+	p = put2(p, tm.tm_sec);
+	memcpy(p, " GMT", 4);
+}
+
+static int month_index(const char* name) {
+	for (int i = 0; i < 12; i++) {
+		if (memcmp(name, month_names[i], 3) == 0)
+			return i;
+	}
+	return -1;
+}
+
+// 依次尝试三种格式，星期不做校验
+// IMF-fixdate  Sun, 06 Nov 1994 08:49:37 GMT
+// RFC 850      Sunday, 06-Nov-94 08:49:37 GMT，两位年份 70 以前视为 20xx
+// asctime      Sun Nov  6 08:49:37 1994
+bool http_date::parse(const char* s, size_t len, time_t* t) {
+	char buf[64];
+	if (len >= sizeof(buf))
+		return false;
+
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+
+	char wday[16];
+	char mon[4];
+	int day, year, hour, min, sec, n = 0;
+
+	bool ok = sscanf(buf, "%3s, %2d %3s %4d %2d:%2d:%2d GMT%n", wday, &day, mon,
+	                 &year, &hour, &min, &sec, &n) == 7;
+
+	if (!ok && sscanf(buf, "%15[A-Za-z], %2d-%3s-%2d %2d:%2d:%2d GMT%n", wday,
+	                  &day, mon, &year, &hour, &min, &sec, &n) == 7) {
+		ok = true;
+		year += year < 70 ? 2000 : 1900;
+	}
+
+	if (!ok)
+		ok = sscanf(buf, "%3s %3s %2d %2d:%2d:%2d %4d%n", wday, mon, &day, &hour,
+		            &min, &sec, &year, &n) == 7;
+
+	if (!ok || (size_t)n != len)
+		return false;
+
+	int month = month_index(mon);
+	if (month < 0 || day < 1 || day > 31 || hour > 23 || min > 59 ||
+	    sec > 60 || year < 1970)
+		return false;
+
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = year - 1900;
+	tm.tm_mon = month;
+	tm.tm_mday = day;
+	tm.tm_hour = hour;
+	tm.tm_min = min;
+	tm.tm_sec = sec;
+
+	*t = timegm(&tm);
+	return *t != (time_t)-1;
+}
+
+// CLOCK_REALTIME_COARSE 经 vDSO 读取，不进入内核
+const char* http_date::header(size_t* len) {
+	static const char prefix[] = "Date: ";
+	static const size_t prefix_len = sizeof(prefix) - 1;
+
+	static thread_local time_t t_sec = -1;
+	static thread_local char t_buf[prefix_len + DATE_LEN + 2];
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME_COARSE, &now);
+
+	if (now.tv_sec != t_sec) {
+		t_sec = now.tv_sec;
+		memcpy(t_buf, prefix, prefix_len);
+		format(now.tv_sec, t_buf + prefix_len);
+		memcpy(t_buf + prefix_len + DATE_LEN, "\r\n", 2);
+	}
+
+	*len = sizeof(t_buf);
+	return t_buf;
+}
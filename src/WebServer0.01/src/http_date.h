@@ -0,0 +1,27 @@
+#ifndef HTTPDATE_H
+#define HTTPDATE_H
+
+#include <stddef.h>
+#include <time.h>
+
+// HTTP 日期（IMF-fixdate，如 "Sun, 06 Nov 1994 08:49:37 GMT"）
+// 按 UTC 格式化与解析，不使用 strftime 与 strptime，不受 locale 影响
+// Date 头部行按线程缓存，同一秒内的应答直接复制缓存的字符串
+class http_date {
+public:
+	static const int DATE_LEN = 29; // IMF-fixdate 的固定长度
+
+public:
+	// 按 IMF-fixdate 格式化，buf 至少 DATE_LEN 字节，不写入 '\0'
+	static void format(time_t t, char* buf);
+
+	// 解析请求中的日期，接受 IMF-fixdate 与已废弃的 RFC 850、asctime 格式
+	// 格式非法时返回 false
+	static bool parse(const char* s, size_t len, time_t* t);
+
+	// 当前时间的 "Date: ...\r\n" 头部行，len 返回其长度
+	// 每个线程每秒只格式化一次，返回值在本线程下一次调用前有效
+	static const char* header(size_t* len);
+};
+
+#endif
@@ -0,0 +1,216 @@
+#include "http_parser.h"
+
+#include <assert.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_PARSER_X86
+#endif
+
+// 逐字节实现，同时处理 SIMD 实现剩余的不足一个向量的尾部
+static const char* find_ctl_scalar(const char* p, const char* end) {
+	for (; p < end; p++) {
+		unsigned char c = *p;
+		if ((c < 0x20 && c != '\t') || c == 0x7f)
+			return p;
+	}
+	return end;
+}
+
+static const char* find_char_scalar(const char* p, const char* end, char a,
+                                    char b) {
+	for (; p < end; p++) {
+		if (*p == a || *p == b)
+			return p;
+	}
+	return end;
+}
+
+#ifdef HTTP_PARSER_X86
+
+// SSE4.2 以 pcmpestri 的范围比较一次检查 16 字节
+// 范围为 0x00-0x08、0x0a-0x1f 与 0x7f，即除 \t 外的控制字符
+__attribute__((target("sse4.2"))) static const char*
+find_ctl_sse42(const char* p, const char* end) {
+	static const char ranges[16] = {0x00, 0x08, 0x0a, 0x1f, 0x7f, 0x7f};
+	const __m128i r = _mm_loadu_si128((const __m128i*)ranges);
+
+	for (; end - p >= 16; p += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i*)p);
+		int idx = _mm_cmpestri(r, 6, b, 16,
+		                       _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+		                           _SIDD_LEAST_SIGNIFICANT);
+		if (idx != 16)
+			return p + idx;
+	}
+
+	return find_ctl_scalar(p, end);
+}
+
+__attribute__((target("sse4.2"))) static const char*
+find_char_sse42(const char* p, const char* end, char a, char b) {
+	const __m128i set = _mm_setr_epi8(a, b, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	                                  0, 0, 0);
+
+	for (; end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		int idx = _mm_cmpestri(set, 2, v, 16,
+		                       _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+		                           _SIDD_LEAST_SIGNIFICANT);
+		if (idx != 16)
+			return p + idx;
+	}
+
+	return find_char_scalar(p, end, a, b);
+}
+
+// AVX2 一次检查 32 字节
+// 无符号 c <= 0x1f 等价于 max(c, 0x1f) == 0x1f
+__attribute__((target("avx2"))) static const char*
+find_ctl_avx2(const char* p, const char* end) {
+	const __m256i c1f = _mm256_set1_epi8(0x1f);
+	const __m256i tab = _mm256_set1_epi8('\t');
+	const __m256i del = _mm256_set1_epi8(0x7f);
+
+	for (; end - p >= 32; p += 32) {
+		__m256i b = _mm256_loadu_si256((const __m256i*)p);
+		__m256i ctl = _mm256_cmpeq_epi8(_mm256_max_epu8(b, c1f), c1f);
+		ctl = _mm256_andnot_si256(_mm256_cmpeq_epi8(b, tab), ctl);
+		ctl = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(b, del));
+
+		unsigned mask = _mm256_movemask_epi8(ctl);
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+
+	return find_ctl_scalar(p, end);
+}
+
+__attribute__((target("avx2"))) static const char*
+find_char_avx2(const char* p, const char* end, char a, char b) {
+	const __m256i va = _mm256_set1_epi8(a);
+	const __m256i vb = _mm256_set1_epi8(b);
+
+	for (; end - p >= 32; p += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)p);
+		__m256i eq =
+		    _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb));
+
+		unsigned mask = _mm256_movemask_epi8(eq);
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+
+	return find_char_scalar(p, end, a, b);
+}
+
+#endif
+
+// 按 CPU 支持情况选择实现
+static const char* select_impl(http_parser::find_ctl_func* find_ctl,
+                               http_parser::find_char_func* find_char) {
+#ifdef HTTP_PARSER_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		*find_ctl = find_ctl_avx2;
+		*find_char = find_char_avx2;
+		return "avx2";
+	}
+
+	if (__builtin_cpu_supports("sse4.2")) {
+		*find_ctl = find_ctl_sse42;
+		*find_char = find_char_sse42;
+		return "sse4.2";
+	}
+#endif
+
+	*find_ctl = find_ctl_scalar;
+	*find_char = find_char_scalar;
+	return "scalar";
+}
+
+http_parser::find_ctl_func http_parser::m_find_ctl = find_ctl_scalar;
+http_parser::find_char_func http_parser::m_find_char = find_char_scalar;
+const char* http_parser::m_simd_name =
+    select_impl(&http_parser::m_find_ctl, &http_parser::m_find_char);
+
+// 已知头部字段名，按 HTTP_HEADER 顺序排列
+static const char* const header_names[HDR_COUNT] = {
+    "",
+    "Host",
+    "Connection",
+    "Keep-Alive",
+    "Content-Length",
+    "Content-Type",
+    "Transfer-Encoding",
+    "TE",
+    "Expect",
+    "Upgrade",
+    "Accept",
+    "Accept-Encoding",
+    "Accept-Language",
+    "If-Modified-Since",
+    "If-Unmodified-Since",
+    "If-None-Match",
+    "If-Match",
+    "If-Range",
+    "Range",
+    "Cache-Control",
+    "Pragma",
+    "User-Agent",
+    "Referer",
+    "Origin",
+    "Cookie",
+    "Authorization",
+};
+
+// 完美哈希
+// 以长度与首尾字符（按小写）计算槽位，系数对上表中的字段名无冲突
+// 增加字段名后若构造时断言失败，需重新选择系数
+static const int HEADER_TABLE_SIZE = 64;
+
+static inline unsigned header_hash(const char* name, size_t len) {
+	return (len * 7 + (name[0] | 0x20) + (name[len - 1] | 0x20) * 40) &
+	       (HEADER_TABLE_SIZE - 1);
+}
+
+struct header_table {
+	unsigned char slots[HEADER_TABLE_SIZE];
+	unsigned char lens[HDR_COUNT];
+
+	header_table() {
+		memset(slots, HDR_UNKNOWN, sizeof(slots));
+		lens[HDR_UNKNOWN] = 0;
+
+		for (int id = HDR_UNKNOWN + 1; id < HDR_COUNT; id++) {
+			lens[id] = strlen(header_names[id]);
+
+			unsigned h = header_hash(header_names[id], lens[id]);
+			assert(slots[h] == HDR_UNKNOWN);
+			slots[h] = id;
+		}
+	}
+};
+
+static const header_table headers;
+
+HTTP_HEADER http_parser::lookup_header(const char* name, size_t len) {
+	if (len == 0)
+		return HDR_UNKNOWN;
+
+	HTTP_HEADER id = (HTTP_HEADER)headers.slots[header_hash(name, len)];
+
+	// 槽位命中后仍需比较一次，排除未知字段名落入同一槽位
+	if (id != HDR_UNKNOWN && headers.lens[id] == len &&
+	    strncasecmp(header_names[id], name, len) == 0)
+		return id;
+
+	return HDR_UNKNOWN;
+}
+
+const char* http_parser::header_name(HTTP_HEADER id) {
+	return header_names[id];
+}
@@ -0,0 +1,86 @@
+#ifndef HTTPPARSER_H
+#define HTTPPARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 已知的请求头部字段
+enum HTTP_HEADER {
+	HDR_UNKNOWN = 0,
+	HDR_HOST,
+	HDR_CONNECTION,
+	HDR_KEEP_ALIVE,
+	HDR_CONTENT_LENGTH,
+	HDR_CONTENT_TYPE,
+	HDR_TRANSFER_ENCODING,
+	HDR_TE,
+	HDR_EXPECT,
+	HDR_UPGRADE,
+	HDR_ACCEPT,
+	HDR_ACCEPT_ENCODING,
+	HDR_ACCEPT_LANGUAGE,
+	HDR_IF_MODIFIED_SINCE,
+	HDR_IF_UNMODIFIED_SINCE,
+	HDR_IF_NONE_MATCH,
+	HDR_IF_MATCH,
+	HDR_IF_RANGE,
+	HDR_RANGE,
+	HDR_CACHE_CONTROL,
+	HDR_PRAGMA,
+	HDR_USER_AGENT,
+	HDR_REFERER,
+	HDR_ORIGIN,
+	HDR_COOKIE,
+	HDR_AUTHORIZATION,
+	HDR_COUNT
+};
+
+// 请求中的一段数据，以相对请求起始位置的偏移表示
+// 不复制也不修改读缓冲区，读缓冲区合并内存块后仍然有效
+struct http_span {
+	uint32_t off;
+	uint32_t len;
+};
+
+// 一个头部字段，value 已去除首尾空白
+struct http_header {
+	HTTP_HEADER id;
+	http_span name;
+	http_span value;
+};
+
+// 请求解析的分词函数
+// 查找行尾与分隔符时按 CPU 支持情况选择 AVX2、SSE4.2 或逐字节实现，启动时确定一次
+// 已知头部字段名通过完美哈希一次查表得到，无需逐个比较
+class http_parser {
+public:
+	// 返回 [p, end) 中第一个控制字符（\t 除外）的位置，没有时返回 end
+	// 合法的请求行与头部中不含控制字符，因此该位置即为行尾的 \r
+	static const char* find_ctl(const char* p, const char* end) {
+		return m_find_ctl(p, end);
+	}
+
+	// 返回 [p, end) 中第一个等于 a 或 b 的字符位置，没有时返回 end
+	static const char* find_char(const char* p, const char* end, char a, char b) {
+		return m_find_char(p, end, a, b);
+	}
+
+	// 按字段名查找已知头部，不区分大小写，未知字段返回 HDR_UNKNOWN
+	static HTTP_HEADER lookup_header(const char* name, size_t len);
+
+	static const char* header_name(HTTP_HEADER id);
+
+	// 当前使用的分词实现
+	static const char* simd_name() { return m_simd_name; }
+
+public:
+	typedef const char* (*find_ctl_func)(const char*, const char*);
+	typedef const char* (*find_char_func)(const char*, const char*, char, char);
+
+private:
+	static find_ctl_func m_find_ctl;
+	static find_char_func m_find_char;
+	static const char* m_simd_name;
+};
+
+#endif
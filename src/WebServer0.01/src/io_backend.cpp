@@ -0,0 +1,63 @@
+#include "io_backend.h"
+#include "uring_backend.h"
+
+#include <unistd.h>
+
+io_backend* io_backend::create(IO_BACKEND type) {
+	if (type == IO_URING) {
+		uring_backend* backend = new uring_backend();
+		if (backend->valid())
+			return backend;
+
+		delete backend;
+		return NULL;
+	}
+
+	epoll_backend* backend = new epoll_backend();
+	if (backend->valid())
+		return backend;
+
+	delete backend;
+	return NULL;
+}
+
+epoll_backend::epoll_backend() : m_epollfd(epoll_create1(EPOLL_CLOEXEC)) {}
+
+epoll_backend::~epoll_backend() {
+	if (m_epollfd != -1)
+		close(m_epollfd);
+}
+
+bool epoll_backend::add(int fd, uint32_t events, uint64_t data) {
+	epoll_event event;
+	event.data.u64 = data;
+	event.events = events;
+	return epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+bool epoll_backend::mod(int fd, uint32_t events, uint64_t data) {
+	epoll_event event;
+	event.data.u64 = data;
+	event.events = events;
+	return epoll_ctl(m_epollfd, EPOLL_CTL_MOD, fd, &event) == 0;
+}
+
+bool epoll_backend::del(int fd) {
+	return epoll_ctl(m_epollfd, EPOLL_CTL_DEL, fd, 0) == 0;
+}
+
+int epoll_backend::wait(io_event* events, int max_events, int timeout) {
+	if ((int)m_events.size() < max_events)
+		m_events.resize(max_events);
+
+	int number = epoll_wait(m_epollfd, &m_events[0], max_events, timeout);
+
+	for (int i = 0; i < number; i++) {
+		events[i].type = IO_READY;
+		events[i].events = m_events[i].events;
+		events[i].data = m_events[i].data.u64;
+		events[i].res = -1;
+	}
+
+	return number;
+}
@@ -0,0 +1,93 @@
+#ifndef IOBACKEND_H
+#define IOBACKEND_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <vector>
+
+// I/O 后端类型
+// IO_EPOLL 使用 epoll_wait/epoll_ctl
+// IO_URING 使用 io_uring：连接注册为固定文件，由内核以提供的缓冲区收取数据、发送应答，
+// 发送完成后接着接收，提交与等待合并为一次 io_uring_enter；内核不支持时退回就绪通知
+enum IO_BACKEND { IO_EPOLL = 0, IO_URING };
+
+// 事件类型
+// IO_READY 为就绪通知，events 为 EPOLL* 标志
+// IO_RECV 为后端已收取的数据，位于 buf 起始的 res 字节，处理完需调用 recycle
+// IO_SEND 为 send 提交的发送已完成，res 为发送的字节数或负的 errno
+enum IO_EVENT_TYPE { IO_READY = 0, IO_RECV, IO_SEND };
+
+// I/O 事件
+// data 为注册该 fd 时传入的数据，原样返回
+// 就绪事件的 res 仅对 io_uring multishot accept 有效，为内核已接受的连接 fd
+struct io_event {
+	int type;
+	uint32_t events;
+	uint64_t data;
+	int res;
+	char* buf;  // IO_RECV 的数据
+	int buf_id; // IO_RECV 的缓冲区编号，由 recycle 使用
+};
+
+// I/O 后端接口
+// 语义与 epoll 相同：add/mod 的事件可带 EPOLLONESHOT，触发一次后需再次 mod
+// add/mod 传入的 data 在该 fd 的事件中返回，对应 epoll_event.data.u64
+// 除 wait、send、cancel_send 与 recycle 外的接口可由线程池中的工作线程调用
+class io_backend {
+public:
+	virtual ~io_backend() {}
+
+	virtual bool add(int fd, uint32_t events, uint64_t data) = 0;
+	virtual bool mod(int fd, uint32_t events, uint64_t data) = 0;
+	virtual bool del(int fd) = 0;
+
+	// 由后端直接接受监听 socket 上的新连接，不支持时返回 false
+	// 成功后 wait 为每个新连接返回一个 res 为连接 fd、data 为传入数据的事件
+	virtual bool add_acceptor(int, uint64_t) { return false; }
+
+	// 由后端收发连接 socket 的数据，不支持时返回 false，调用者改用 add 注册就绪事件
+	// 成功后立即开始接收；此后 mod 带 EPOLLIN 时提交一次接收，收到数据返回 IO_RECV 事件，
+	// 对端关闭或出错时返回带 EPOLLRDHUP 或 EPOLLERR 的就绪事件；带 EPOLLOUT 时仍为一次就绪通知
+	virtual bool add_stream(int, uint64_t) { return false; }
+
+	// 发送 msg 描述的全部数据，完成后返回 IO_SEND 事件，msg 及其引用的内存需保持到该事件返回
+	// recv_after 为真时全部发出后接着提交一次接收，未全部发出则不接收
+	// 只用于 add_stream 注册的 fd，不支持时返回 false
+	virtual bool send(int, const msghdr*, bool) { return false; }
+
+	// 取消进行中的发送，IO_SEND 事件随后返回
+	virtual void cancel_send(int) {}
+
+	// 归还 IO_RECV 事件的缓冲区
+	virtual void recycle(const io_event&) {}
+
+	// 等待就绪事件，timeout 单位为毫秒，-1 表示一直等待
+	virtual int wait(io_event* events, int max_events, int timeout) = 0;
+
+	virtual const char* name() const = 0;
+
+	// 创建指定类型后端，失败时返回 NULL
+	static io_backend* create(IO_BACKEND type);
+};
+
+// epoll 后端
+class epoll_backend : public io_backend {
+public:
+	epoll_backend();
+	~epoll_backend();
+
+	bool add(int fd, uint32_t events, uint64_t data);
+	bool mod(int fd, uint32_t events, uint64_t data);
+	bool del(int fd);
+	int wait(io_event* events, int max_events, int timeout);
+	const char* name() const { return "epoll"; }
+
+	bool valid() const { return m_epollfd != -1; }
+
+private:
+	int m_epollfd;
+	std::vector<epoll_event> m_events;
+};
+
+#endif
@@ -1,23 +1,26 @@
 #include "../../base/ThreadPool/src/ThreadPool.h"
+#include "hot_upgrade.h"
 #include "http_conn.h"
+#include "mime_types.h"
+#include "reactor.h"
+#include "server_config.h"
+#include "server_log.h"
 
+#include <algorithm>
 #include <arpa/inet.h>
 #include <cassert>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/epoll.h> 
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <thread>
 #include <unistd.h>
-
-#define MAX_FD 65536
-#define MAX_EVENT_NUMBER 10000
-
-extern int addfd(int epollfd, int fd, bool one_shot);
-extern int removefd(int epollfd, int fd);
+#include <vector>
 
 void addsig(int sig, void(handler)(int), bool restart = true) {
 	struct sigaction sa;
@@ -32,115 +35,197 @@ void addsig(int sig, void(handler)(int), bool restart = true) {
 	assert(sigaction(sig, &sa, NULL) != -1);
 }
 
-void show_error(int connfd, const char* info) {
-	printf("%s", info);
-	send(connfd, info, strlen(info), 0);
-	close(connfd);
+// 配置的日志级别，SIGUSR1 在该级别与 DEBUG 之间切换
+static fmtlog::LogLevel base_log_level = fmtlog::INF;
+
+void toggle_debug_log(int) {
+	server_log::set_level(server_log::get_level() == fmtlog::DBG
+	                          ? base_log_level
+	                          : fmtlog::DBG);
 }
 
-int main(int argc, char* argv[]) {
-	if (argc <= 2) {
-		printf("usage: %s ip_address port_number\n", basename(argv[0]));
-		return 1;
-	}
+void init_log(const server_config& config) {
+	server_log::parse_level(config.log_level.c_str(), &base_log_level);
+	server_log::set_sample_rate(config.log_sample);
+	server_log::init(config.log_file.empty() ? NULL : config.log_file.c_str(),
+	                 base_log_level);
+	addsig(SIGUSR1, toggle_debug_log);
+}
 
-	const char* ip = argv[1];
-	int port = atoi(argv[2]);
+// 只在启动时生效的配置
+void apply_startup(const server_config& config) {
+	buffer_pool::instance().set_chunk_size(config.chunk_size);
+	http_conn::set_doc_root(config.doc_root.c_str());
+	http_conn::set_max_read_size(config.max_request_size);
+
+	// 覆盖文件有误时仍以内置表运行
+	std::string error;
+	if (!config.mime_types.empty() &&
+	    !mime_types::load(config.mime_types.c_str(), &error))
+		logw("load mime types failed: {}, using built-in table", error);
+}
 
-	// 忽略 SIGPIPE 信号
+// 可在运行中修改的配置，各项均可由其他线程安全地设置
+void apply_reloadable(const server_config& config) {
+	reactor::set_max_conns(config.max_conns);
+	reactor::set_timeouts(config.header_timeout, config.idle_timeout,
+	                      config.body_timeout, config.write_timeout);
+
+	file_cache::instance().set_capacity(config.cache_capacity);
+	http_conn::set_sendfile_threshold(config.sendfile_threshold);
+	http_conn::set_prerender_threshold(config.prerender_threshold);
+	http_conn::set_compression(config.precompressed, config.compress_min_size,
+	                           config.compress_max_size);
+	file_cache::instance().set_compression(config.compress_cache_capacity,
+	                                       config.compress_level);
+
+	server_log::parse_level(config.log_level.c_str(), &base_log_level);
+	server_log::set_level(base_log_level);
+	server_log::set_sample_rate(config.log_sample);
+}
 
-	// 构建线程池指针
-	std::unique_ptr<TP::UThreadPool> threadpool(new TP::UThreadPool());
+// SIGHUP 时重新读取配置文件，失败时保持原有配置
+// 不能重新加载的配置项只提示，仍以启动时的取值运行
+void reload_config(const server_config& running) {
+	server_config next = running;
+	std::string error;
 
-	// 预先为每个可能客户连接分配一个 http_conn 对象
-	http_conn* users = new http_conn[MAX_FD];
-	assert(users);
-	int user_count = 0;
+	if (!next.load(&error)) {
+		logw("reload config failed: {}", error);
+		return;
+	}
 
-	int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-	assert(listenfd >= 0);
-	struct linger tmp = {1, 0};
-	setsockopt(listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
+	std::string ignored = next.diff_static(running);
+	if (!ignored.empty())
+		logw("reload config: {} changed, restart required", ignored);
 
-	int ret = 0;
-	struct sockaddr_in address;
-	bzero(&address, sizeof(address));
-	address.sin_family = AF_INET;
-	inet_pton(AF_INET, ip, &address.sin_addr);
-	address.sin_port = htons(port);
+	apply_reloadable(next);
+	logi("config reloaded");
+}
 
-	ret = bind(listenfd, (struct sockaddr*)&address, sizeof(address));
-	assert(ret >= 0);
+int main(int argc, char* argv[]) {
+	server_config config;
+	std::string error;
 
-	ret = listen(listenfd, 5);
-	assert(ret >= 0);
+	if (!config.parse_args(argc, argv, &error)) {
+		if (!error.empty())
+			fprintf(stderr, "%s\n", error.c_str());
+		fprintf(stderr, "%s", server_config::usage());
+		return 1;
+	}
 
-	epoll_event events[MAX_EVENT_NUMBER];
-	int epollfd = epoll_create(5);
-	assert(epollfd != -1);
-	addfd(epollfd, listenfd, false);
-	http_conn::m_epollfd = epollfd;
+	hot_upgrade::init(argv);
+
+	// 子反应堆数量，为 0 时按 CPU 核数创建
+	int reactor_num = config.reactors;
+	if (reactor_num <= 0)
+		reactor_num = std::max(1u, std::thread::hardware_concurrency());
+
+	// 在 reactor 线程内完成请求处理，仅阻塞处理函数交给线程池
+	DISPATCH_MODE mode = config.inline_mode ? DISPATCH_INLINE : DISPATCH_POOL;
+
+	// I/O 后端，启动时选定
+	IO_BACKEND backend = config.backend == "uring" ? IO_URING : IO_EPOLL;
+
+	// 忽略 SIGPIPE 信号，对端已关闭时 writev 与 sendfile 返回 EPIPE 而不是终止进程
+	// 信号处置对整个进程生效，在创建 reactor 线程前设置
+	addsig(SIGPIPE, SIG_IGN);
+
+	init_log(config);
+	logi("tokenizer: {}", http_parser::simd_name());
+
+	apply_startup(config);
+	apply_reloadable(config);
+
+	// 错误页与小文件使用预先生成的应答
+	http_conn::init_responses();
+
+	// 保留的 URL，输出服务器指标
+	http_conn::register_handler("/metrics", http_conn::serve_metrics, false);
+
+	// 上传测试，消息体边读入边丢弃
+	http_conn::register_handler("/upload", http_conn::serve_upload, false,
+	                            (1 << http_conn::POST) | (1 << http_conn::PUT),
+	                            http_conn::discard_body);
+
+	// 以下信号由主线程同步等待，须在创建其他线程前屏蔽，使其只投递给主线程
+	// SIGHUP 重新加载配置，SIGTERM 与 SIGINT 平滑停止，SIGUSR2 平滑升级
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGHUP);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	// 由旧进程升级启动时沿用其监听 socket，数量多于配置的 reactor 数时按其数量创建，
+	// 否则旧进程退出时多出的 socket 中积压的连接会被重置
+	std::vector<int> listenfds;
+	if (hot_upgrade::inherit(&listenfds) &&
+	    (int)listenfds.size() > reactor_num) {
+		logw("upgrade: {} reactors configured, run {} to serve every listener",
+		     reactor_num, listenfds.size());
+		reactor_num = listenfds.size();
+	}
 
+	// 构建线程池指针
+	TP::UThreadPoolConfig pool_config;
+	pool_config.default_thread_size_ = config.threads;
+	pool_config.max_thread_size_ = config.max_threads;
+	std::unique_ptr<TP::UThreadPool> threadpool(
+	    new TP::UThreadPool(true, pool_config));
+
+	// inline 模式下即时压缩在线程池中进行，不阻塞 reactor 线程
+	file_cache::instance().set_thread_pool(threadpool.get());
+
+	// 每个 reactor 拥有独立的 I/O 后端与 SO_REUSEPORT 监听 socket
+	std::vector<std::unique_ptr<reactor>> reactors;
+	for (int i = 0; i < reactor_num; i++)
+		reactors.emplace_back(new reactor(
+		    config.ip.c_str(), config.port, threadpool.get(), mode, backend,
+		    config.backlog, config.max_events,
+		    i < (int)listenfds.size() ? listenfds[i] : -1));
+
+	// 每个 reactor 各占一个线程，主线程处理信号
+	std::vector<std::thread> threads;
+	for (int i = 0; i < reactor_num; i++)
+		threads.emplace_back(&reactor::run, reactors[i].get());
+
+	hot_upgrade::ready();
+
+	// 停止时监听 socket 已交给新进程则不再接受 backlog 中的连接
+	bool handed_off = false;
 	while (true) {
-		int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
-
-		if ((number < 0) && (errno != EINTR)) {
-			printf("epoll failure\n");
+		int sig;
+		if (sigwait(&signals, &sig) != 0)
+			continue;
+
+		if (sig == SIGHUP) {
+			reload_config(config);
+		} else if (sig == SIGUSR2) {
+			std::vector<int> fds;
+			for (auto& r : reactors)
+				fds.push_back(r->get_listenfd());
+
+			if (hot_upgrade::start(fds)) {
+				handed_off = true;
+				break;
+			}
+		} else {
+			logi("received signal {}, shutting down", sig);
 			break;
 		}
+	}
 
-		for (int i = 0; i < number; i++) {
-			int sockfd = events[i].data.fd;
-
-			if (sockfd == listenfd) {
-				struct sockaddr_in client_address;
-				socklen_t client_addrlength = sizeof(client_address);
-				int connfd = accept(listenfd, (struct sockaddr*)&client_address,
-				                    &client_addrlength);
-
-				if (connfd < 0){
-					printf("errno is: %d\n", errno);
-					continue;
-				}
-
-				if (http_conn::m_user_count >= MAX_FD) {
-					show_error(connfd, "Internal server busy");
-					continue;
-				}
-
-				// 初始化连接
-				users[connfd].init(connfd, client_address);
-			} else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-
-				// 有异常，直接关闭连接
-				users[sockfd].close_conn();
-			} else if (events[i].events & EPOLLIN) {
-
-				// 根据读结果决定是否放入线程池
-				if (users[sockfd].read()) {
-
-					// 使用 lambda 表达式包装提交任务
-					threadpool->commit([users,sockfd] {
-						(users+sockfd)->process();
-                    });
-				}
-				else
-					users[sockfd].close_conn();
-
-			} else if (events[i].events & EPOLLOUT) {
-
-				// 根据写的结果决定是否关闭连接
-				if (!users[sockfd].write())
-					users[sockfd].close_conn();
-			} else {
-			}
-			
-        }
-    }
+	for (auto& r : reactors)
+		r->stop(config.shutdown_timeout, !handed_off);
 
-	close(epollfd);
-	close(listenfd);
-	delete[] users;
+	for (auto& t : threads)
+		t.join();
+
+	logi("all connections closed, exit");
+
+	reactors.clear();
+	server_log::shutdown();
 	return 0;
-	
-}
\ No newline at end of file
+}
@@ -0,0 +1,147 @@
+#include "metrics.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+std::mutex metrics::m_mutex;
+std::vector<metrics::shard*> metrics::m_shards;
+
+// 值初始化将全部计数清零
+metrics::shard* metrics::register_shard() {
+	shard* s = new shard();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_shards.push_back(s);
+	return s;
+}
+
+static void append(std::string* out, const char* format, ...) {
+	char buf[256];
+	va_list arg_list;
+	va_start(arg_list, format);
+	int len = vsnprintf(buf, sizeof(buf), format, arg_list);
+	va_end(arg_list);
+
+	if (len > 0)
+		out->append(buf, len < (int)sizeof(buf) ? len : sizeof(buf) - 1);
+}
+
+static void append_counter(std::string* out, const char* name, const char* help,
+                           uint64_t value) {
+	append(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help,
+	       name, name, (unsigned long long)value);
+}
+
+// 各分片的增量分别读取，汇总值可能短暂为负
+static void append_gauge(std::string* out, const char* name, const char* help,
+                         int64_t value) {
+	append(out, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", name, help, name,
+	       name, (long long)value);
+}
+
+void metrics::render(std::string* out) {
+	uint64_t counters[MC_COUNT] = {0};
+	uint64_t gauges[MG_COUNT] = {0};
+	uint64_t status[MAX_STATUS] = {0};
+	static uint64_t buckets[MH_COUNT][HISTOGRAM_BUCKETS];
+	uint64_t sums[MH_COUNT] = {0};
+
+	// 多个线程同时读取时共用汇总缓冲区，整个汇总过程持锁
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	memset(buckets, 0, sizeof(buckets));
+
+	for (size_t i = 0; i < m_shards.size(); i++) {
+		const shard* s = m_shards[i];
+
+		for (int id = 0; id < MC_COUNT; id++)
+			counters[id] += s->counters[id].load(std::memory_order_relaxed);
+		for (int id = 0; id < MG_COUNT; id++)
+			gauges[id] += s->gauges[id].load(std::memory_order_relaxed);
+		for (int code = 0; code < MAX_STATUS; code++)
+			status[code] += s->status[code].load(std::memory_order_relaxed);
+
+		for (int id = 0; id < MH_COUNT; id++) {
+			const histogram& h = s->histograms[id];
+			for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+				buckets[id][b] += h.buckets[b].load(std::memory_order_relaxed);
+			sums[id] += h.sum.load(std::memory_order_relaxed);
+		}
+	}
+
+	append_counter(out, "webserver_connections_accepted_total",
+	               "Accepted connections.", counters[MC_CONN_ACCEPTED]);
+	append_counter(out, "webserver_connections_closed_total",
+	               "Closed connections.", counters[MC_CONN_CLOSED]);
+	append_counter(out, "webserver_received_bytes_total",
+	               "Bytes read from clients.", counters[MC_BYTES_IN]);
+	append_counter(out, "webserver_sent_bytes_total", "Bytes sent to clients.",
+	               counters[MC_BYTES_OUT]);
+	append_counter(out, "webserver_parse_errors_total",
+	               "Requests rejected as malformed.", counters[MC_PARSE_ERRORS]);
+	append_gauge(out, "webserver_connections", "Active connections.",
+	             gauges[MG_CONNECTIONS]);
+	append_gauge(out, "webserver_pool_queue_depth",
+	             "Tasks waiting in the thread pool queue.",
+	             gauges[MG_POOL_QUEUE]);
+
+	append(out, "# HELP webserver_requests_total Responses sent, by status "
+	            "code.\n# TYPE webserver_requests_total counter\n");
+	for (int code = 0; code < MAX_STATUS; code++) {
+		if (status[code])
+			append(out, "webserver_requests_total{code=\"%d\"} %llu\n", code,
+			       (unsigned long long)status[code]);
+	}
+
+	// 对外按 4 倍递增的边界输出累计桶，分位数由细分的子桶计算
+	const char* name = "webserver_request_duration_seconds";
+	const uint64_t* hist = buckets[MH_REQUEST_DURATION];
+
+	uint64_t total = 0;
+	for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+		total += hist[b];
+
+	append(out, "# HELP %s Time from the first request byte read to the last "
+	            "response byte written.\n# TYPE %s histogram\n",
+	       name, name);
+
+	uint64_t cumulative = 0;
+	int b = 0;
+	for (int shift = 10; shift <= 34; shift += 2) {
+		uint64_t bound = (uint64_t)1 << shift;
+		for (; b < HISTOGRAM_BUCKETS && bucket_lower(b) < bound; b++)
+			cumulative += hist[b];
+
+		append(out, "%s_bucket{le=\"%.9g\"} %llu\n", name, bound / 1e9,
+		       (unsigned long long)cumulative);
+	}
+	append(out, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+	       (unsigned long long)total);
+	append(out, "%s_sum %.9g\n%s_count %llu\n", name,
+	       sums[MH_REQUEST_DURATION] / 1e9, name, (unsigned long long)total);
+
+	static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+	append(out, "# HELP %s_quantile Request duration quantiles, accurate to "
+	            "1/%d.\n# TYPE %s_quantile gauge\n",
+	       name, SUB_BUCKETS, name);
+
+	for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+		uint64_t rank = (uint64_t)(quantiles[q] * total);
+		uint64_t seen = 0;
+		double value = 0;
+
+		// 取排名所在子桶的中点
+		for (int i = 0; i < HISTOGRAM_BUCKETS - 1 && total > 0; i++) {
+			seen += hist[i];
+			if (seen > rank) {
+				uint64_t lower = bucket_lower(i);
+				value = (lower + (bucket_lower(i + 1) - lower) / 2.0) / 1e9;
+				break;
+			}
+		}
+
+		append(out, "%s_quantile{quantile=\"%g\"} %.9g\n", name, quantiles[q],
+		       value);
+	}
+}
@@ -0,0 +1,126 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// 计数器，只增不减
+enum METRIC_COUNTER {
+	MC_CONN_ACCEPTED = 0,
+	MC_CONN_CLOSED,
+	MC_BYTES_IN,
+	MC_BYTES_OUT,
+	MC_PARSE_ERRORS,
+	MC_COUNT
+};
+
+// 可增可减的量，各线程只记录自己的增量，汇总时求和
+enum METRIC_GAUGE {
+	MG_CONNECTIONS = 0, // 活动连接数
+	MG_POOL_QUEUE,      // 已投递线程池尚未开始执行的任务数
+	MG_COUNT
+};
+
+// 延迟直方图，单位为纳秒
+enum METRIC_HISTOGRAM {
+	MH_REQUEST_DURATION = 0, // 读入请求首字节到应答最后一个字节写出
+	MH_COUNT
+};
+
+// 服务器指标
+// 每个线程首次记录时分配一个分片，此后只写自己的分片，写入不加锁也不使用原子读改写
+// 读取时遍历全部分片求和，只在登记分片时与新线程竞争一次锁，不影响请求处理
+// 线程退出后分片保留，已记录的计数不会丢失
+class metrics {
+public:
+	// HDR 风格直方图：每个 2 的幂区间再等分为 SUB_BUCKETS 个子桶，相对误差不超过 1/SUB_BUCKETS
+	static const int SUB_BUCKET_BITS = 3;
+	static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+	static const int HISTOGRAM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+	static const int MAX_STATUS = 600; // 按状态码计数的范围
+
+public:
+	static void add(METRIC_COUNTER id, uint64_t n = 1) {
+		bump(local()->counters[id], n);
+	}
+
+	static void add(METRIC_GAUGE id, int64_t n) {
+		bump(local()->gauges[id], (uint64_t)n);
+	}
+
+	// 记录一个已发送完毕的应答
+	static void count_status(int status) {
+		if (status < 0 || status >= MAX_STATUS)
+			status = 0;
+		bump(local()->status[status], 1);
+	}
+
+	static void record(METRIC_HISTOGRAM id, int64_t ns) {
+		if (ns < 0)
+			ns = 0;
+
+		histogram& h = local()->histograms[id];
+		bump(h.buckets[bucket_index(ns)], 1);
+		bump(h.sum, ns);
+	}
+
+	// 以 Prometheus 文本格式输出全部指标
+	static void render(std::string* out);
+
+private:
+	struct histogram {
+		std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+		std::atomic<uint64_t> sum;
+	};
+
+	// 按缓存行对齐，避免不同线程的分片共享缓存行
+	struct alignas(64) shard {
+		std::atomic<uint64_t> counters[MC_COUNT];
+		std::atomic<uint64_t> gauges[MG_COUNT]; // 以补码累加有符号增量
+		std::atomic<uint64_t> status[MAX_STATUS];
+		histogram histograms[MH_COUNT];
+	};
+
+	// 分片只由所属线程写入，普通读写即可，原子类型只为保证汇总线程读到完整的值
+	static void bump(std::atomic<uint64_t>& v, uint64_t n) {
+		v.store(v.load(std::memory_order_relaxed) + n,
+		        std::memory_order_relaxed);
+	}
+
+	static shard* local() {
+		static thread_local shard* t_shard = NULL;
+		if (!t_shard)
+			t_shard = register_shard();
+		return t_shard;
+	}
+
+	static shard* register_shard();
+
+	static int bucket_index(uint64_t v) {
+		if (v < (uint64_t)SUB_BUCKETS)
+			return v;
+
+		int e = 63 - __builtin_clzll(v);
+		return (e - SUB_BUCKET_BITS + 1) * SUB_BUCKETS +
+		       ((v >> (e - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+	}
+
+	// 桶的下界，上界为下一个桶的下界
+	static uint64_t bucket_lower(int idx) {
+		if (idx < SUB_BUCKETS)
+			return idx;
+
+		int group = idx / SUB_BUCKETS;
+		return (uint64_t)(SUB_BUCKETS + idx % SUB_BUCKETS) << (group - 1);
+	}
+
+private:
+	static std::mutex m_mutex;           // 保护分片列表
+	static std::vector<shard*> m_shards;
+};
+
+#endif
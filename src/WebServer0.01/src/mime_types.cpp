@@ -0,0 +1,244 @@
+#include "mime_types.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+std::unordered_map<std::string, mime_types::override_type>
+    mime_types::m_overrides;
+
+// 超过该长度的扩展名不查表
+static const size_t MAX_EXT_LEN = 32;
+
+struct builtin_type {
+	const char* ext;
+	size_t ext_len;
+	mime_type type;
+};
+
+// 头部行在编译期拼接
+#define CONTENT_TYPE_LINE(value) "Content-Type: " value "\r\n"
+#define MIME(ext, value, compressible)                                         \
+	{ext, sizeof(ext) - 1,                                                     \
+	 {CONTENT_TYPE_LINE(value), sizeof(CONTENT_TYPE_LINE(value)) - 1,         \
+	  compressible}}
+
+static constexpr builtin_type builtin[] = {
+    MIME("html", "text/html", true),
+    MIME("htm", "text/html", true),
+    MIME("shtml", "text/html", true),
+    MIME("xhtml", "application/xhtml+xml", true),
+    MIME("css", "text/css", true),
+    MIME("xml", "text/xml", true),
+    MIME("js", "text/javascript", true),
+    MIME("mjs", "text/javascript", true),
+    MIME("json", "application/json", true),
+    MIME("jsonld", "application/ld+json", true),
+    MIME("map", "application/json", true),
+    MIME("txt", "text/plain", true),
+    MIME("csv", "text/csv", true),
+    MIME("md", "text/markdown", true),
+    MIME("yaml", "application/yaml", true),
+    MIME("yml", "application/yaml", true),
+    MIME("rss", "application/rss+xml", true),
+    MIME("atom", "application/atom+xml", true),
+    MIME("webmanifest", "application/manifest+json", true),
+    MIME("svg", "image/svg+xml", true),
+    MIME("png", "image/png", false),
+    MIME("jpg", "image/jpeg", false),
+    MIME("jpeg", "image/jpeg", false),
+    MIME("gif", "image/gif", false),
+    MIME("webp", "image/webp", false),
+    MIME("avif", "image/avif", false),
+    MIME("ico", "image/x-icon", false),
+    MIME("bmp", "image/bmp", false),
+    MIME("tif", "image/tiff", false),
+    MIME("tiff", "image/tiff", false),
+    MIME("woff", "font/woff", false),
+    MIME("woff2", "font/woff2", false),
+    MIME("ttf", "font/ttf", false),
+    MIME("otf", "font/otf", false),
+    MIME("eot", "application/vnd.ms-fontobject", false),
+    MIME("pdf", "application/pdf", false),
+    MIME("zip", "application/zip", false),
+    MIME("gz", "application/gzip", false),
+    MIME("tar", "application/x-tar", false),
+    MIME("wasm", "application/wasm", false),
+    MIME("mp3", "audio/mpeg", false),
+    MIME("ogg", "audio/ogg", false),
+    MIME("wav", "audio/wav", false),
+    MIME("flac", "audio/flac", false),
+    MIME("m4a", "audio/mp4", false),
+    MIME("mp4", "video/mp4", false),
+    MIME("webm", "video/webm", false),
+    MIME("mov", "video/quicktime", false),
+    MIME("avi", "video/x-msvideo", false),
+    MIME("mpeg", "video/mpeg", false),
+    MIME("mpg", "video/mpeg", false),
+};
+
+static constexpr size_t BUILTIN_COUNT = sizeof(builtin) / sizeof(builtin[0]);
+
+static const mime_type default_type = {
+    CONTENT_TYPE_LINE("application/octet-stream"),
+    sizeof(CONTENT_TYPE_LINE("application/octet-stream")) - 1, false};
+
+// 完美哈希
+// 以长度与首、中、尾字符（按小写）计算槽位，系数对上表中的扩展名无冲突
+// 增加扩展名后若编译期断言失败，需重新选择系数
+static constexpr unsigned MIME_TABLE_SIZE = 128;
+
+static constexpr unsigned lower(char c) { return (unsigned char)c | 0x20; }
+
+static constexpr unsigned ext_hash(const char* ext, size_t len) {
+	return (len * 13 + lower(ext[0]) + lower(ext[len - 1]) * 18 +
+	        lower(ext[len / 2]) * 7) &
+	       (MIME_TABLE_SIZE - 1);
+}
+
+struct mime_table {
+	unsigned char slots[MIME_TABLE_SIZE]; // 内置表下标加 1，0 为空槽位
+	bool perfect;
+
+	constexpr mime_table() : slots(), perfect(true) {
+		for (size_t i = 0; i < BUILTIN_COUNT; i++) {
+			unsigned h = ext_hash(builtin[i].ext, builtin[i].ext_len);
+			if (slots[h] != 0)
+				perfect = false;
+			slots[h] = i + 1;
+		}
+	}
+};
+
+static constexpr mime_table table;
+static_assert(table.perfect, "mime extension hash collides");
+static_assert(BUILTIN_COUNT < 256, "mime slot index overflows");
+
+const mime_type& mime_types::lookup(const char* name, size_t len) {
+	// 最后一个 '.' 之后的部分为扩展名，'.' 不能在最后一个 '/' 之前
+	const char* end = name + len;
+	const char* ext = NULL;
+	for (const char* p = end; p > name;) {
+		--p;
+		if (*p == '/')
+			break;
+		if (*p == '.') {
+			ext = p + 1;
+			break;
+		}
+	}
+
+	size_t ext_len = ext ? end - ext : 0;
+	if (ext_len == 0 || ext_len > MAX_EXT_LEN)
+		return default_type;
+
+	if (!m_overrides.empty()) {
+		std::string key(ext, ext_len);
+		for (size_t i = 0; i < ext_len; i++)
+			key[i] = lower(key[i]);
+
+		auto it = m_overrides.find(key);
+		if (it != m_overrides.end())
+			return it->second.type;
+	}
+
+	unsigned slot = table.slots[ext_hash(ext, ext_len)];
+	if (slot != 0) {
+		const builtin_type& entry = builtin[slot - 1];
+
+		// 槽位命中后仍需比较一次，排除未知扩展名落入同一槽位
+		if (entry.ext_len == ext_len &&
+		    strncasecmp(entry.ext, ext, ext_len) == 0)
+			return entry.type;
+	}
+
+	return default_type;
+}
+
+// 覆盖项的类型未知是否为文本，按类型名判断
+static bool compressible_type(const std::string& type) {
+	return type.compare(0, 5, "text/") == 0 ||
+	       type.find("json") != std::string::npos ||
+	       type.find("xml") != std::string::npos ||
+	       type.find("javascript") != std::string::npos;
+}
+
+// 去掉 nginx 风格的行尾 ';'
+static char* trim_semicolon(char* token) {
+	size_t len = strlen(token);
+	while (len > 0 && token[len - 1] == ';')
+		token[--len] = '\0';
+	return token;
+}
+
+// 全部读取成功后才替换已有的覆盖项
+// 类型可带不含空白的参数，如 text/html;charset=utf-8，扩展名允许带前导 '.'
+bool mime_types::load(const char* path, std::string* error) {
+	FILE* fp = fopen(path, "r");
+	if (!fp) {
+		*error = std::string(path) + ": " + strerror(errno);
+		return false;
+	}
+
+	std::unordered_map<std::string, override_type> overrides;
+	char line[1024];
+	int line_no = 0;
+	bool ok = true;
+
+	while (fgets(line, sizeof(line), fp)) {
+		line_no++;
+
+		char* hash = strchr(line, '#');
+		if (hash)
+			*hash = '\0';
+
+		char* save = NULL;
+		const char* delims = " \t\r\n";
+		char* type = strtok_r(line, delims, &save);
+		if (!type || !*trim_semicolon(type))
+			continue;
+
+		size_t type_len = strlen(type);
+		if (!strchr(type, '/') || type_len > 128) {
+			char buf[64];
+			snprintf(buf, sizeof(buf), ":%d: invalid type", line_no);
+			*error = std::string(path) + buf;
+			ok = false;
+			break;
+		}
+
+		for (char* ext = strtok_r(NULL, delims, &save); ext;
+		     ext = strtok_r(NULL, delims, &save)) {
+			trim_semicolon(ext);
+			if (*ext == '.')
+				ext++;
+
+			size_t ext_len = strlen(ext);
+			if (ext_len == 0 || ext_len > MAX_EXT_LEN)
+				continue;
+
+			for (size_t i = 0; i < ext_len; i++)
+				ext[i] = lower(ext[i]);
+
+			override_type& entry = overrides[ext];
+			entry.header = "Content-Type: ";
+			entry.header.append(type, type_len);
+			entry.header.append("\r\n");
+			entry.type.compressible = compressible_type(type);
+		}
+	}
+
+	fclose(fp);
+	if (!ok)
+		return false;
+
+	// 节点不再移动，此时再取头部行的地址
+	for (auto& kv : overrides) {
+		kv.second.type.header = kv.second.header.data();
+		kv.second.type.header_len = kv.second.header.size();
+	}
+
+	m_overrides.swap(overrides);
+	return true;
+}
@@ -0,0 +1,38 @@
+#ifndef MIMETYPES_H
+#define MIMETYPES_H
+
+#include <stddef.h>
+#include <string>
+#include <unordered_map>
+
+// 一种内容类型，header 为完整的 "Content-Type: ...\r\n" 头部行，应答时直接复制
+struct mime_type {
+	const char* header;
+	size_t header_len;
+	bool compressible; // 文本类内容，值得压缩
+};
+
+// 扩展名到内容类型的映射
+// 内置表在编译期以完美哈希构造，查找时一次取槽位并比较一次扩展名
+// 可从 mime.types 格式的文件加载覆盖项，覆盖项优先于内置表
+class mime_types {
+public:
+	// 按文件名的扩展名查找，不区分大小写，未知扩展名返回 application/octet-stream
+	// 返回值在进程存续期间有效
+	static const mime_type& lookup(const char* name, size_t len);
+
+	// 读取 mime.types 格式的文件，每行为类型与若干扩展名，# 开始注释
+	// 需在 reactor 启动前调用
+	static bool load(const char* path, std::string* error);
+
+private:
+	struct override_type {
+		std::string header;
+		mime_type type;
+	};
+
+	// 扩展名（小写）到覆盖项，节点地址稳定，type.header 指向同一节点中的 header
+	static std::unordered_map<std::string, override_type> m_overrides;
+};
+
+#endif
@@ -0,0 +1,483 @@
+#include "reactor.h"
+#include "metrics.h"
+#include "server_log.h"
+
+#include <arpa/inet.h>
+#include <cassert>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+extern void addfd(io_backend* backend, int fd, uint64_t data, bool one_shot);
+
+// 监听 socket 与 inotify 描述符注册时使用的数据
+// 代数为 0，不会与连接对象池分配的句柄相同
+static const uint64_t LISTEN_HANDLE = 0xffffffff;
+static const uint64_t NOTIFY_HANDLE = 0xfffffffe;
+static const uint64_t WAKE_HANDLE = 0xfffffffd;
+
+std::atomic<int> reactor::m_header_timeout(DEFAULT_HEADER_TIMEOUT);
+std::atomic<int> reactor::m_idle_timeout(DEFAULT_IDLE_TIMEOUT);
+std::atomic<int> reactor::m_body_timeout(DEFAULT_BODY_TIMEOUT);
+std::atomic<int> reactor::m_write_timeout(DEFAULT_WRITE_TIMEOUT);
+std::atomic<int> reactor::m_max_conns(DEFAULT_MAX_CONNS);
+
+static int relaxed(const std::atomic<int>& v) {
+	return v.load(std::memory_order_relaxed);
+}
+
+static int64_t now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+reactor::reactor(const char* ip, int port, TP::UThreadPool* threadpool,
+                 DISPATCH_MODE mode, IO_BACKEND backend, int backlog,
+                 int max_events, int listenfd)
+    : m_accepting(false), m_accept_pending(false), m_stop_requested(false),
+      m_stop_timeout(DEFAULT_SHUTDOWN_TIMEOUT), m_drain_backlog(true),
+      m_stopping(false), m_stop_deadline(0), m_threadpool(threadpool),
+      m_mode(mode), m_max_events(max_events) {
+
+	// 交来的 socket 已在监听，再次 listen 只更新 backlog
+	if (listenfd >= 0) {
+		m_listenfd = listenfd;
+		listen(m_listenfd, backlog);
+	} else
+		m_listenfd = create_listenfd(ip, port, backlog);
+
+	m_events = new io_event[m_max_events];
+
+	// 所选后端不可用时退回 epoll
+	m_backend = io_backend::create(backend);
+	if (!m_backend) {
+		logw("io backend {} unavailable, fall back to epoll", (int)backend);
+		m_backend = io_backend::create(IO_EPOLL);
+	}
+	assert(m_backend);
+
+	resume_accept();
+
+	m_notifyfd = file_cache::instance().get_notify_fd();
+	if (m_notifyfd >= 0)
+		addfd(m_backend, m_notifyfd, NOTIFY_HANDLE, false);
+
+	m_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	assert(m_wakefd >= 0);
+	addfd(m_backend, m_wakefd, WAKE_HANDLE, false);
+}
+
+reactor::~reactor() {
+	delete m_backend;
+	if (m_listenfd >= 0)
+		close(m_listenfd);
+	close(m_wakefd);
+	delete[] m_events;
+}
+
+void reactor::stop(int timeout_ms, bool drain_backlog) {
+	m_stop_timeout.store(timeout_ms, std::memory_order_relaxed);
+	m_drain_backlog.store(drain_backlog, std::memory_order_relaxed);
+	m_stop_requested.store(true, std::memory_order_release);
+
+	uint64_t one = 1;
+	ssize_t ret = write(m_wakefd, &one, sizeof(one));
+	(void)ret;
+}
+
+void reactor::set_timeouts(int header_ms, int idle_ms, int body_ms,
+                           int write_ms) {
+	m_header_timeout.store(header_ms, std::memory_order_relaxed);
+	m_idle_timeout.store(idle_ms, std::memory_order_relaxed);
+	m_body_timeout.store(body_ms, std::memory_order_relaxed);
+	m_write_timeout.store(write_ms, std::memory_order_relaxed);
+}
+
+int reactor::create_listenfd(const char* ip, int port, int backlog) {
+	int listenfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	assert(listenfd >= 0);
+
+	// 多个 reactor 绑定同一地址，由内核负载均衡新连接
+	int reuse = 1;
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+
+	int ret = 0;
+	struct sockaddr_in address;
+	bzero(&address, sizeof(address));
+	address.sin_family = AF_INET;
+	inet_pton(AF_INET, ip, &address.sin_addr);
+	address.sin_port = htons(port);
+
+	ret = bind(listenfd, (struct sockaddr*)&address, sizeof(address));
+	assert(ret >= 0);
+
+	// 超过 net.core.somaxconn 时由内核截断
+	ret = listen(listenfd, backlog);
+	assert(ret >= 0);
+
+	return listenfd;
+}
+
+// 开始或恢复接受新连接，后端支持时由其直接完成 accept
+void reactor::resume_accept() {
+	if (!m_backend->add_acceptor(m_listenfd, LISTEN_HANDLE))
+		addfd(m_backend, m_listenfd, LISTEN_HANDLE, false);
+
+	m_accepting = true;
+	m_accept_pending = true; // 暂停期间积压的连接不会再产生边沿事件
+}
+
+// 连接数已满时注销监听 socket，新连接留在内核 backlog 中，而不是接受后立即关闭
+void reactor::pause_accept() {
+	if (!m_accepting)
+		return;
+
+	m_backend->del(m_listenfd);
+	m_accepting = false;
+	m_accept_pending = false;
+	logwl(1000000000, "connection limit {} reached, pause accepting",
+	      relaxed(m_max_conns));
+}
+
+// 监听 socket 可读时以 accept4 直接取得非阻塞连接，每轮事件循环至多接受 ACCEPT_BATCH 个
+// 预算用完时置 m_accept_pending，下一轮不等待事件继续接受，避免连接风暴独占事件循环
+// io_uring 后端已由内核接受连接时 connfd 为连接 fd
+void reactor::handle_accept(int connfd) {
+	struct sockaddr_in client_address;
+	socklen_t client_addrlength = sizeof(client_address);
+
+	// 已停止接受，io_uring 取消前已接受的连接仍会送达
+	if (connfd < 0 && m_listenfd < 0)
+		return;
+
+	if (connfd >= 0) {
+		// 连接已被接受，连接数已满时只能关闭
+		if (http_conn::m_user_count >= relaxed(m_max_conns)) {
+			close(connfd);
+			pause_accept();
+			return;
+		}
+
+		getpeername(connfd, (struct sockaddr*)&client_address,
+		            &client_addrlength);
+		add_conn(connfd, client_address);
+
+		// 内核持续接受连接，达到上限时立即取消 accept，使后续连接留在 backlog 中
+		if (http_conn::m_user_count >= relaxed(m_max_conns))
+			pause_accept();
+		return;
+	}
+
+	m_accept_pending = false;
+
+	for (int i = 0; i < ACCEPT_BATCH; i++) {
+		if (http_conn::m_user_count >= relaxed(m_max_conns)) {
+			pause_accept();
+			return;
+		}
+
+		client_addrlength = sizeof(client_address);
+		connfd = accept4(m_listenfd, (struct sockaddr*)&client_address,
+		                 &client_addrlength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (connfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+
+			// 文件描述符用尽等错误，暂停接受，待有连接关闭后再恢复
+			logwl(1000000000, "accept failed, errno is: {}", errno);
+			pause_accept();
+			return;
+		}
+
+		add_conn(connfd, client_address);
+	}
+
+	m_accept_pending = true;
+}
+
+void reactor::add_conn(int connfd, const sockaddr_in& client_address) {
+	// 从对象池取连接对象并初始化，连接以其句柄注册到本 reactor 的 I/O 后端
+	uint64_t handle;
+	http_conn* conn = m_conns.alloc(&handle);
+	conn->init(connfd, client_address, m_backend, handle);
+
+	// 新连接须在读取请求头的期限内发来完整请求
+	conn->m_timer_kind = http_conn::TIMER_HEADER;
+	m_timers.add(&conn->m_timer, relaxed(m_header_timeout));
+}
+
+// 仅在连接未交给线程池时调用
+// 读取请求头的期限自连接建立或上一次响应完成起计算且不随后续数据刷新，防止慢速发送头部长期占用连接
+// 消息体可能很大，只限制两次读入之间的间隔
+void reactor::update_timer(http_conn& conn) {
+	if (conn.m_sockfd == -1 || conn.m_busy.load(std::memory_order_acquire) > 0)
+		return;
+
+	switch (conn.get_phase()) {
+	case http_conn::PHASE_WRITING:
+		conn.m_timer_kind = http_conn::TIMER_WRITE;
+		m_timers.add(&conn.m_timer, relaxed(m_write_timeout));
+		break;
+	case http_conn::PHASE_READING:
+		if (conn.m_timer_kind != http_conn::TIMER_HEADER) {
+			conn.m_timer_kind = http_conn::TIMER_HEADER;
+			m_timers.add(&conn.m_timer, relaxed(m_header_timeout));
+		}
+		break;
+	case http_conn::PHASE_BODY:
+		conn.m_timer_kind = http_conn::TIMER_BODY;
+		m_timers.add(&conn.m_timer, relaxed(m_body_timeout));
+		break;
+	case http_conn::PHASE_IDLE:
+		// 空闲连接只在完成一次响应后才会走到这里，每次都重新计时
+		conn.m_timer_kind = http_conn::TIMER_IDLE;
+		m_timers.add(&conn.m_timer, relaxed(m_idle_timeout));
+		break;
+	}
+}
+
+// 定时器到期时关闭连接，已关闭的连接此时归还对象池
+void reactor::handle_expire(timer_node* node) {
+	http_conn* conn = (http_conn*)node->data;
+
+	// 仍在线程池中处理，推迟到下一个 tick 再检查
+	if (conn->m_busy.load(std::memory_order_acquire) > 0) {
+		m_timers.add(node, m_timers.tick_ms());
+		return;
+	}
+
+	// 后端仍在发送，取消后等待完成事件，由其关闭连接
+	if (conn->is_sending()) {
+		conn->cancel_send();
+		m_timers.add(node, m_timers.tick_ms());
+		return;
+	}
+
+	conn->close_conn();
+	m_conns.release(conn);
+}
+
+// 关闭连接并将连接对象归还对象池
+void reactor::close_conn(http_conn* conn) {
+	conn->close_conn();
+	release_conn(conn);
+}
+
+// 工作线程重新注册事件后到结束占用前，连接可能已因新事件被关闭
+// 此时对象仍被工作线程引用，推迟到下一个 tick 由 handle_expire 归还
+void reactor::release_conn(http_conn* conn) {
+	if (conn->m_busy.load(std::memory_order_acquire) > 0) {
+		m_timers.add(&conn->m_timer, m_timers.tick_ms());
+		return;
+	}
+
+	m_conns.release(conn);
+}
+
+void reactor::handle_read(http_conn* conn) {
+	if (!conn->read()) {
+		close_conn(conn);
+		return;
+	}
+
+	if (m_mode == DISPATCH_POOL) {
+		// 使用 lambda 表达式包装提交任务
+		conn->m_busy.fetch_add(1, std::memory_order_relaxed);
+		metrics::add(MG_POOL_QUEUE, 1);
+		m_threadpool->commit([conn] {
+			metrics::add(MG_POOL_QUEUE, -1);
+			conn->process();
+		});
+	} else if (conn->process_inline()) {
+		// 仅阻塞处理函数交给线程池
+		conn->m_busy.fetch_add(1, std::memory_order_relaxed);
+		metrics::add(MG_POOL_QUEUE, 1);
+		m_threadpool->commit([conn] {
+			metrics::add(MG_POOL_QUEUE, -1);
+			conn->process_handler();
+		});
+	} else if (conn->m_sockfd == -1) {
+		// 发送失败或不再保持连接，已在 process_inline 中关闭
+		release_conn(conn);
+	}
+}
+
+// 停止接受新连接，需要时先取走 backlog 中的连接
+// 监听 socket 随后关闭，SO_REUSEPORT 组中仍在监听的 socket 不受影响
+void reactor::begin_stop() {
+	m_stopping = true;
+	m_stop_deadline = now_ms() + relaxed(m_stop_timeout);
+	http_conn::set_draining(true);
+
+	if (m_accepting) {
+		m_backend->del(m_listenfd);
+		m_accepting = false;
+	}
+	m_accept_pending = false;
+
+	if (m_drain_backlog.load(std::memory_order_relaxed)) {
+		while (true) {
+			struct sockaddr_in client_address;
+			socklen_t client_addrlength = sizeof(client_address);
+			int connfd = accept4(m_listenfd, (struct sockaddr*)&client_address,
+			                     &client_addrlength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (connfd < 0) {
+				if (errno == EINTR || errno == ECONNABORTED)
+					continue;
+				break;
+			}
+			add_conn(connfd, client_address);
+		}
+	}
+
+	close(m_listenfd);
+	m_listenfd = -1;
+
+	logi("reactor stopping, {} connections to drain", m_conns.size());
+}
+
+// 已完成应答的空闲连接立即关闭，正在读取或发送的连接处理完当前请求后关闭
+// 期限已到时关闭全部连接，线程池中仍在处理的连接等其结束后再关闭
+bool reactor::drain() {
+	bool expired = now_ms() >= m_stop_deadline;
+
+	m_conns.for_each([this, expired](http_conn* conn) {
+		if (conn->m_sockfd == -1 ||
+		    conn->m_busy.load(std::memory_order_acquire) > 0)
+			return;
+
+		// 后端仍在发送，到期时取消，完成事件到达后关闭
+		if (conn->is_sending()) {
+			if (expired)
+				conn->cancel_send();
+			return;
+		}
+
+		if (expired || (conn->m_timer_kind == http_conn::TIMER_IDLE &&
+		                conn->get_phase() == http_conn::PHASE_IDLE))
+			close_conn(conn);
+	});
+
+	return m_conns.size() == 0;
+}
+
+void reactor::run() {
+	while (true) {
+		// 有定时器或暂停接受连接时每个 tick 醒来一次，有未接受完的连接时不等待
+		int timeout = m_timers.empty() && m_accepting ? -1 : m_timers.tick_ms();
+		if (m_accept_pending)
+			timeout = 0;
+		if (m_stopping)
+			timeout = m_timers.tick_ms();
+
+		int number = m_backend->wait(m_events, m_max_events, timeout);
+
+		if ((number < 0) && (errno != EINTR)) {
+			loge("{} failure, errno is: {}", m_backend->name(), errno);
+			break;
+		}
+
+		for (int i = 0; i < number; i++) {
+			uint64_t handle = m_events[i].data;
+
+			if (handle == LISTEN_HANDLE) {
+				handle_accept(m_events[i].res);
+				continue;
+			} else if (handle == NOTIFY_HANDLE) {
+
+				// 被缓存的文件发生变化
+				file_cache::instance().handle_notify();
+				continue;
+			} else if (handle == WAKE_HANDLE) {
+				uint64_t count;
+				ssize_t ret = read(m_wakefd, &count, sizeof(count));
+				(void)ret;
+				continue;
+			}
+
+			// 句柄已失效或连接已关闭，丢弃迟到的事件
+			http_conn* conn = m_conns.get(handle);
+			bool alive = conn && conn->m_sockfd != -1;
+
+			if (m_events[i].type == IO_RECV) {
+				// 后端收取的数据复制到读缓冲区后立即归还其缓冲区
+				if (alive)
+					conn->read(m_events[i].buf, m_events[i].res);
+				m_backend->recycle(m_events[i]);
+
+				if (alive) {
+					handle_read(conn);
+					update_timer(*conn);
+				}
+				continue;
+			}
+
+			if (!alive)
+				continue;
+
+			if (m_events[i].type == IO_SEND) {
+
+				// 后端完成发送，与 EPOLLOUT 后的 write 相同处理
+				if (!conn->send_done(m_events[i].res))
+					close_conn(conn);
+				else {
+					if (conn->has_pipelined())
+						handle_read(conn);
+					update_timer(*conn);
+				}
+			} else if (m_events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+
+				// 有异常，直接关闭连接
+				close_conn(conn);
+			} else if (m_events[i].events & EPOLLIN) {
+
+				// 根据处理模式决定是否放入线程池
+				handle_read(conn);
+				update_timer(*conn);
+			} else if (m_events[i].events & EPOLLOUT) {
+
+				// 根据写的结果决定是否关闭连接
+				// 发送完毕后读缓冲区中仍有流水线请求时立即处理
+				if (!conn->write())
+					close_conn(conn);
+				else {
+					if (conn->has_pipelined())
+						handle_read(conn);
+					update_timer(*conn);
+				}
+			}
+		}
+
+		// 批量关闭超时连接
+		m_timers.advance([this](timer_node* node) { handle_expire(node); });
+
+		// 开始停止后再等待一轮，收取 io_uring 取消 accept 前已接受的连接
+		if (!m_stopping &&
+		    m_stop_requested.load(std::memory_order_acquire)) {
+			begin_stop();
+			continue;
+		}
+
+		if (m_stopping) {
+			if (drain())
+				break;
+			continue;
+		}
+
+		if (m_accept_pending)
+			handle_accept(-1);
+		else if (!m_accepting && http_conn::m_user_count < relaxed(m_max_conns))
+			resume_accept();
+	}
+}
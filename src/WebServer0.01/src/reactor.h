@@ -0,0 +1,116 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "../../base/ThreadPool/src/ThreadPool.h"
+#include "conn_pool.h"
+#include "http_conn.h"
+#include "io_backend.h"
+#include "timer_wheel.h"
+
+#define DEFAULT_MAX_CONNS 65536  // 默认最大连接数，所有 reactor 合计
+#define DEFAULT_MAX_EVENTS 10000 // 默认每次等待返回的最大事件数
+#define DEFAULT_BACKLOG 1024 // 监听 socket 的默认 backlog
+#define ACCEPT_BATCH 64      // 每轮事件循环最多接受的连接数
+
+#define DEFAULT_HEADER_TIMEOUT 10000 // 默认读取请求头超时 10 s
+#define DEFAULT_IDLE_TIMEOUT 15000   // 默认 keep-alive 空闲超时 15 s
+#define DEFAULT_BODY_TIMEOUT 30000   // 默认消息体接收停滞超时 30 s
+#define DEFAULT_WRITE_TIMEOUT 30000  // 默认发送停滞超时 30 s
+#define DEFAULT_SHUTDOWN_TIMEOUT 30000 // 默认停止时等待处理完已有请求的期限 30 s
+
+// 请求处理模式
+// DISPATCH_POOL 读完数据后将解析与应答交给线程池
+// DISPATCH_INLINE 在 reactor 线程内完成解析、应答与发送，仅阻塞处理函数交给线程池
+enum DISPATCH_MODE { DISPATCH_POOL = 0, DISPATCH_INLINE };
+
+// 子反应堆
+// 每个 reactor 独占一个 I/O 后端（epoll 或 io_uring）和一个 SO_REUSEPORT 监听 socket
+// 由内核在各监听 socket 之间分发新连接，accept、读、解析、写均在本线程完成
+// 每个 reactor 拥有独立的连接对象池，连接以对象池句柄注册到 I/O 后端，
+// 连接关闭后 fd 被复用也不会让旧事件落到新连接上
+class reactor {
+public:
+	// listenfd 不小于 0 时使用已监听的 socket（平滑升级时由旧进程交来），否则新建
+	reactor(const char* ip, int port, TP::UThreadPool* threadpool,
+	        DISPATCH_MODE mode = DISPATCH_POOL, IO_BACKEND backend = IO_EPOLL,
+	        int backlog = DEFAULT_BACKLOG, int max_events = DEFAULT_MAX_EVENTS,
+	        int listenfd = -1);
+	~reactor();
+
+	reactor(const reactor&) = delete;
+	reactor& operator=(const reactor&) = delete;
+
+public:
+	void run(); // 事件循环，stop 后处理完已有连接返回
+
+	// 停止接受新连接，已有请求在 timeout_ms 内处理完毕，到期后关闭剩余连接
+	// 空闲的 keep-alive 连接立即关闭，此后的应答均不再保持连接
+	// drain_backlog 为真时先接受 backlog 中已完成握手的连接，随后关闭监听 socket；
+	// 监听 socket 已交给新进程时为假，积压的连接留给新进程
+	// 可由其他线程调用
+	void stop(int timeout_ms, bool drain_backlog);
+
+	// 监听 socket，平滑升级时交给新进程
+	int get_listenfd() const { return m_listenfd; }
+
+	// 设置全部 reactor 的超时时间，单位毫秒
+	// header 为收到请求首字节后读完请求头的期限，idle 为 keep-alive 空闲期限，
+	// body 为接收消息体无进展的期限，write 为发送无进展的期限
+	// 可在运行中由其他线程调用，此后设置的定时器生效
+	static void set_timeouts(int header_ms, int idle_ms, int body_ms,
+	                         int write_ms);
+
+	// 设置最大连接数，可在运行中由其他线程调用
+	// 调低后已有连接不受影响，连接数降到上限以下才恢复接受
+	static void set_max_conns(int conns) {
+		m_max_conns.store(conns, std::memory_order_relaxed);
+	}
+
+private:
+	int create_listenfd(const char* ip, int port,
+	                    int backlog);              // 创建并监听 SO_REUSEPORT socket
+	void handle_accept(int connfd);                // 接受新连接
+	void add_conn(int connfd, const sockaddr_in& client_address);
+	void pause_accept();                           // 连接数已满时暂停接受连接
+	void resume_accept();
+	void handle_read(http_conn* conn);             // 处理可读事件
+	void close_conn(http_conn* conn);              // 关闭连接并归还连接对象
+	void release_conn(http_conn* conn);            // 归还已关闭的连接对象
+	void update_timer(http_conn& conn);            // 按连接阶段设置定时器
+	void handle_expire(timer_node* node);          // 定时器到期
+	void begin_stop();                             // 开始停止
+	bool drain();                                  // 关闭可关闭的连接，全部归还后返回 true
+
+private:
+	io_backend* m_backend; // 本 reactor 的 I/O 后端
+	int m_listenfd; // 本 reactor 的监听 socket
+	bool m_accepting;      // 监听 socket 已注册
+	bool m_accept_pending; // 上一轮用完预算，backlog 中可能还有连接
+	int m_notifyfd; // 文件缓存的 inotify 描述符，各 reactor 共同监听
+	int m_wakefd;   // eventfd，其他线程请求停止时唤醒事件循环
+
+	// 停止请求由其他线程设置，m_stopping 及以下只由本线程访问
+	std::atomic<bool> m_stop_requested;
+	std::atomic<int> m_stop_timeout;
+	std::atomic<bool> m_drain_backlog;
+	bool m_stopping;
+	int64_t m_stop_deadline; // CLOCK_MONOTONIC 毫秒
+
+	conn_pool m_conns;             // 本 reactor 的连接对象池
+	TP::UThreadPool* m_threadpool; // 共享的线程池
+	DISPATCH_MODE m_mode;          // 请求处理模式
+
+	io_event* m_events; // 就绪事件数组
+	int m_max_events;
+
+	// 连接超时管理
+	timer_wheel m_timers;
+
+	static std::atomic<int> m_header_timeout;
+	static std::atomic<int> m_idle_timeout;
+	static std::atomic<int> m_body_timeout;
+	static std::atomic<int> m_write_timeout;
+	static std::atomic<int> m_max_conns;
+};
+
+#endif
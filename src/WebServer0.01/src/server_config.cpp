@@ -0,0 +1,396 @@
+#include "server_config.h"
+#include "chain_buffer.h"
+#include "file_cache.h"
+#include "http_conn.h"
+#include "reactor.h"
+#include "server_log.h"
+
+extern "C" {
+#include "leptjson.h"
+}
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+server_config::server_config() { reset(); }
+
+void server_config::reset() {
+	ip = "0.0.0.0";
+	port = 9006;
+	backlog = DEFAULT_BACKLOG;
+
+	reactors = 1;
+	inline_mode = false;
+	backend = "epoll";
+	max_events = DEFAULT_MAX_EVENTS;
+	max_conns = DEFAULT_MAX_CONNS;
+
+	// 相对于工作目录，即在 src/WebServer0.01 下启动时仓库自带的页面
+	doc_root = "../template/html";
+	mime_types.clear();
+
+	chunk_size = buffer_pool::DEFAULT_CHUNK_SIZE;
+	max_request_size = http_conn::DEFAULT_MAX_READ_SIZE;
+
+	cache_capacity = file_cache::DEFAULT_CAPACITY;
+	sendfile_threshold = http_conn::DEFAULT_SENDFILE_THRESHOLD;
+	prerender_threshold = http_conn::DEFAULT_PRERENDER_THRESHOLD;
+
+	precompressed = true;
+	compress_min_size = http_conn::DEFAULT_COMPRESS_MIN_SIZE;
+	compress_max_size = http_conn::DEFAULT_COMPRESS_MAX_SIZE;
+	compress_level = file_cache::DEFAULT_COMPRESS_LEVEL;
+	compress_cache_capacity = file_cache::DEFAULT_COMPRESS_CAPACITY;
+
+	header_timeout = DEFAULT_HEADER_TIMEOUT;
+	idle_timeout = DEFAULT_IDLE_TIMEOUT;
+	body_timeout = DEFAULT_BODY_TIMEOUT;
+	write_timeout = DEFAULT_WRITE_TIMEOUT;
+	shutdown_timeout = DEFAULT_SHUTDOWN_TIMEOUT;
+
+	threads = 8;
+	max_threads = 16;
+
+	log_file.clear();
+	log_level = "info";
+	log_sample = 1;
+}
+
+// 只有 set 经由返回的指针修改成员
+std::vector<server_config::option> server_config::options() const {
+	const long MAX_TIMEOUT = 24 * 3600 * 1000;
+	server_config* self = const_cast<server_config*>(this);
+
+	option opts[] = {
+	    {"listen.ip", OPT_STRING, &self->ip, 0, 0, false},
+	    {"listen.port", OPT_NUMBER, &self->port, 1, 65535, false},
+	    {"listen.backlog", OPT_NUMBER, &self->backlog, 1, INT_MAX, false},
+	    {"reactors", OPT_NUMBER, &self->reactors, 0, 1024, false},
+	    {"inline", OPT_BOOL, &self->inline_mode, 0, 0, false},
+	    {"backend", OPT_STRING, &self->backend, 0, 0, false},
+	    {"max_events", OPT_NUMBER, &self->max_events, 1, 1 << 20, false},
+	    {"max_connections", OPT_NUMBER, &self->max_conns, 1, INT_MAX, true},
+	    {"doc_root", OPT_STRING, &self->doc_root, 0, 0, false},
+	    {"mime_types", OPT_STRING, &self->mime_types, 0, 0, false},
+	    {"buffer.chunk_size", OPT_NUMBER, &self->chunk_size,
+	     (long)buffer_pool::MIN_CHUNK_SIZE, (long)buffer_pool::MAX_CHUNK_SIZE,
+	     false},
+	    {"buffer.max_request_size", OPT_NUMBER, &self->max_request_size, 1024,
+	     1 << 30, false},
+	    {"cache.capacity", OPT_NUMBER, &self->cache_capacity, 0, LONG_MAX, true},
+	    {"cache.sendfile_threshold", OPT_NUMBER, &self->sendfile_threshold, -1,
+	     LONG_MAX, true},
+	    {"cache.prerender_threshold", OPT_NUMBER, &self->prerender_threshold, -1,
+	     LONG_MAX, true},
+	    {"compression.precompressed", OPT_BOOL, &self->precompressed, 0, 0, true},
+	    {"compression.min_size", OPT_NUMBER, &self->compress_min_size, 0,
+	     LONG_MAX, true},
+	    {"compression.max_size", OPT_NUMBER, &self->compress_max_size, 0,
+	     LONG_MAX, true},
+	    {"compression.level", OPT_NUMBER, &self->compress_level, 1, 9, true},
+	    {"compression.cache_capacity", OPT_NUMBER,
+	     &self->compress_cache_capacity, 0, LONG_MAX, true},
+	    {"timeouts.header_ms", OPT_NUMBER, &self->header_timeout, 100, MAX_TIMEOUT,
+	     true},
+	    {"timeouts.idle_ms", OPT_NUMBER, &self->idle_timeout, 100, MAX_TIMEOUT,
+	     true},
+	    {"timeouts.body_ms", OPT_NUMBER, &self->body_timeout, 100, MAX_TIMEOUT,
+	     true},
+	    {"timeouts.write_ms", OPT_NUMBER, &self->write_timeout, 100, MAX_TIMEOUT,
+	     true},
+	    {"timeouts.shutdown_ms", OPT_NUMBER, &self->shutdown_timeout, 0,
+	     MAX_TIMEOUT, false},
+	    {"thread_pool.threads", OPT_NUMBER, &self->threads, 1, 1024, false},
+	    {"thread_pool.max_threads", OPT_NUMBER, &self->max_threads, 1, 1024, false},
+	    {"log.file", OPT_STRING, &self->log_file, 0, 0, false},
+	    {"log.level", OPT_STRING, &self->log_level, 0, 0, true},
+	    {"log.sample", OPT_NUMBER, &self->log_sample, 1, INT_MAX, true},
+	};
+
+	return std::vector<option>(opts, opts + sizeof(opts) / sizeof(opts[0]));
+}
+
+static bool check_range(const char* name, long value, long min, long max,
+                        std::string* error) {
+	if (value >= min && value <= max)
+		return true;
+
+	char buf[256];
+	snprintf(buf, sizeof(buf), "%s: %ld out of range [%ld, %ld]", name, value,
+	         min, max);
+	*error = buf;
+	return false;
+}
+
+bool server_config::set(const std::string& name, const std::string& value,
+                        std::string* error) {
+	std::vector<option> opts = options();
+
+	for (size_t i = 0; i < opts.size(); i++) {
+		const option& opt = opts[i];
+		if (name != opt.name)
+			continue;
+
+		switch (opt.type) {
+		case OPT_NUMBER: {
+			char* end;
+			errno = 0;
+			long v = strtol(value.c_str(), &end, 10);
+			if (value.empty() || *end != '\0' || errno == ERANGE) {
+				*error = name + ": not a number: " + value;
+				return false;
+			}
+			if (!check_range(opt.name, v, opt.min, opt.max, error))
+				return false;
+			*(long*)opt.value = v;
+			return true;
+		}
+		case OPT_BOOL:
+			if (value == "1" || value == "true" || value == "on") {
+				*(bool*)opt.value = true;
+				return true;
+			}
+			if (value == "0" || value == "false" || value == "off") {
+				*(bool*)opt.value = false;
+				return true;
+			}
+			*error = name + ": not a boolean: " + value;
+			return false;
+		case OPT_STRING:
+			*(std::string*)opt.value = value;
+			return true;
+		}
+	}
+
+	*error = "unknown option: " + name;
+	return false;
+}
+
+// 配置文件中的一个值，null 表示取默认值
+static bool assign_json(const std::string& name, const lept_value* v,
+                        std::string* value, std::string* error) {
+	char buf[64];
+
+	switch (lept_get_type(v)) {
+	case LEPT_NULL:
+		return true;
+	case LEPT_TRUE:
+		*value = "true";
+		return true;
+	case LEPT_FALSE:
+		*value = "false";
+		return true;
+	case LEPT_NUMBER: {
+		double n = lept_get_number(v);
+		if (n != (double)(long)n) {
+			*error = name + ": not an integer";
+			return false;
+		}
+		snprintf(buf, sizeof(buf), "%ld", (long)n);
+		*value = buf;
+		return true;
+	}
+	case LEPT_STRING:
+		value->assign(lept_get_string(v), lept_get_string_length(v));
+		return true;
+	default:
+		*error = name + ": unexpected array";
+		return false;
+	}
+}
+
+// 嵌套对象的键以 '.' 连接为配置项名字
+static bool walk_json(const lept_value* obj, const std::string& prefix,
+                      std::vector<std::pair<std::string, std::string>>* out,
+                      std::string* error) {
+	for (size_t i = 0; i < lept_get_object_size(obj); i++) {
+		std::string name(lept_get_object_key(obj, i),
+		                 lept_get_object_key_length(obj, i));
+		if (!prefix.empty())
+			name = prefix + "." + name;
+
+		const lept_value* v = lept_get_object_value_by_index(obj, i);
+
+		if (lept_get_type(v) == LEPT_OBJECT) {
+			if (!walk_json(v, name, out, error))
+				return false;
+			continue;
+		}
+
+		std::string value;
+		if (!assign_json(name, v, &value, error))
+			return false;
+
+		if (lept_get_type(v) != LEPT_NULL)
+			out->push_back(std::make_pair(name, value));
+	}
+
+	return true;
+}
+
+static bool read_file(const char* path, std::string* data) {
+	FILE* fp = fopen(path, "rb");
+	if (!fp)
+		return false;
+
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		data->append(buf, n);
+
+	bool ok = !ferror(fp);
+	fclose(fp);
+	return ok;
+}
+
+bool server_config::load(std::string* error) {
+	reset();
+
+	std::vector<std::pair<std::string, std::string>> values;
+
+	if (!m_path.empty()) {
+		std::string data;
+		if (!read_file(m_path.c_str(), &data)) {
+			*error = m_path + ": " + strerror(errno);
+			return false;
+		}
+
+		lept_value root;
+		lept_value_init(&root);
+		int ret = lept_parse(&root, data.c_str());
+
+		bool ok = false;
+		if (ret != LEPT_PARSE_OK) {
+			char buf[64];
+			snprintf(buf, sizeof(buf), ": JSON parse error %d", ret);
+			*error = m_path + buf;
+		} else if (lept_get_type(&root) != LEPT_OBJECT)
+			*error = m_path + ": top level must be an object";
+		else
+			ok = walk_json(&root, "", &values, error);
+
+		lept_free(&root);
+		if (!ok)
+			return false;
+	}
+
+	values.insert(values.end(), m_overrides.begin(), m_overrides.end());
+	for (size_t i = 0; i < values.size(); i++) {
+		if (!set(values[i].first, values[i].second, error))
+			return false;
+	}
+
+	if (backend != "epoll" && backend != "uring") {
+		*error = "backend: must be epoll or uring";
+		return false;
+	}
+
+	fmtlog::LogLevel level;
+	if (!server_log::parse_level(log_level.c_str(), &level)) {
+		*error = "log.level: unknown level " + log_level;
+		return false;
+	}
+
+	if (doc_root.empty() || doc_root.size() >= file_cache::MAX_ROOT_LEN) {
+		*error = "doc_root: empty or too long";
+		return false;
+	}
+
+	if (max_threads < threads) {
+		*error = "thread_pool.max_threads: less than thread_pool.threads";
+		return false;
+	}
+
+	return true;
+}
+
+bool server_config::parse_args(int argc, char* argv[], std::string* error) {
+	static const char* positional[] = {"listen.ip", "listen.port", "reactors",
+	                                   "inline", "backend"};
+	size_t npos = 0;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+
+		if (arg == "-h" || arg == "--help") {
+			error->clear();
+			return false;
+		} else if (arg == "-c" && i + 1 < argc) {
+			m_path = argv[++i];
+		} else if (arg.compare(0, 9, "--config=") == 0) {
+			m_path = arg.substr(9);
+		} else if (arg.compare(0, 2, "--") == 0) {
+			// 布尔配置项可省略取值
+			size_t eq = arg.find('=');
+			if (eq == std::string::npos)
+				m_overrides.push_back(std::make_pair(arg.substr(2), "true"));
+			else
+				m_overrides.push_back(
+				    std::make_pair(arg.substr(2, eq - 2), arg.substr(eq + 1)));
+		} else if (npos < sizeof(positional) / sizeof(positional[0])) {
+			m_overrides.push_back(std::make_pair(positional[npos++], arg));
+		} else {
+			*error = "unexpected argument: " + arg;
+			return false;
+		}
+	}
+
+	return load(error);
+}
+
+std::string server_config::diff_static(const server_config& other) const {
+	std::vector<option> mine = options();
+	std::vector<option> theirs = other.options();
+	std::string changed;
+
+	for (size_t i = 0; i < mine.size(); i++) {
+		if (mine[i].reloadable)
+			continue;
+
+		bool same = false;
+		switch (mine[i].type) {
+		case OPT_NUMBER:
+			same = *(long*)mine[i].value == *(long*)theirs[i].value;
+			break;
+		case OPT_BOOL:
+			same = *(bool*)mine[i].value == *(bool*)theirs[i].value;
+			break;
+		case OPT_STRING:
+			same = *(std::string*)mine[i].value ==
+			       *(std::string*)theirs[i].value;
+			break;
+		}
+
+		if (!same) {
+			if (!changed.empty())
+				changed += ", ";
+			changed += mine[i].name;
+		}
+	}
+
+	return changed;
+}
+
+const char* server_config::usage() {
+	return "usage: out [-c config.json] [--name=value ...] "
+	       "[ip port [reactors] [inline] [epoll|uring]]\n"
+	       "options (config file keys, nested objects joined with '.'):\n"
+	       "  listen.ip listen.port listen.backlog reactors inline backend\n"
+	       "  max_events max_connections* doc_root mime_types\n"
+	       "  buffer.chunk_size buffer.max_request_size\n"
+	       "  cache.capacity* cache.sendfile_threshold* "
+	       "cache.prerender_threshold*\n"
+	       "  compression.precompressed* compression.min_size* "
+	       "compression.max_size*\n"
+	       "  compression.level* compression.cache_capacity*\n"
+	       "  timeouts.header_ms* timeouts.idle_ms* timeouts.body_ms*\n"
+	       "  timeouts.write_ms* timeouts.shutdown_ms\n"
+	       "  thread_pool.threads thread_pool.max_threads\n"
+	       "  log.file log.level* log.sample*\n"
+	       "* reloaded on SIGHUP\n"
+	       "relative doc_root and mime_types paths are resolved against the\n"
+	       "working directory, doc_root defaults to ../template/html\n";
+}
@@ -0,0 +1,103 @@
+#ifndef SERVERCONFIG_H
+#define SERVERCONFIG_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// 服务器配置
+// 依次取默认值、JSON 配置文件与命令行参数，后者覆盖前者
+// 配置项以带分组的名字标识，如 "timeouts.idle_ms"，配置文件中写作嵌套对象
+// 命令行以 --timeouts.idle_ms=5000 覆盖单项
+//
+// 标记为可重新加载的配置项在 SIGHUP 时重新读取配置文件后立即生效，不断开已有连接
+// 其余配置项只在启动时读取，修改后需重启
+class server_config {
+public:
+	// 监听地址
+	std::string ip;
+	long port;
+	long backlog;
+
+	// 反应堆与请求处理
+	long reactors;        // 为 0 时按 CPU 核数创建
+	bool inline_mode;     // 在 reactor 线程内完成请求处理
+	std::string backend;  // epoll 或 uring
+	long max_events;      // 每次等待返回的最大事件数
+	long max_conns;       // 最大连接数，可重新加载
+
+	// 静态文件
+	std::string doc_root;
+	std::string mime_types; // mime.types 格式的覆盖文件，为空时只用内置表
+
+	// 缓冲区
+	long chunk_size;       // 缓冲区内存块大小
+	long max_request_size; // 请求头与缓存的消息体的大小上限，流式处理的消息体不受限
+
+	// 文件缓存，均可重新加载
+	long cache_capacity;
+	long sendfile_threshold;
+	long prerender_threshold;
+
+	// 压缩，均可重新加载
+	bool precompressed;         // 使用预压缩的 .br 与 .gz 兄弟文件
+	long compress_min_size;     // 即时压缩的文件大小范围，max 为 0 时关闭
+	long compress_max_size;
+	long compress_level;
+	long compress_cache_capacity; // 即时压缩结果的缓存预算
+
+	// 超时，单位毫秒，均可重新加载
+	long header_timeout;
+	long idle_timeout;
+	long body_timeout;
+	long write_timeout;
+	long shutdown_timeout; // 停止时等待处理完已有请求的期限
+
+	// 线程池
+	long threads;     // 常驻线程数
+	long max_threads; // 繁忙时最多扩充到的线程数
+
+	// 日志，级别与采样率可重新加载
+	std::string log_file; // 为空时输出到 stdout
+	std::string log_level;
+	long log_sample;
+
+public:
+	server_config();
+
+	// 解析命令行，随后加载配置
+	// 兼容旧的位置参数 ip port [reactors] [inline] [epoll|uring]
+	bool parse_args(int argc, char* argv[], std::string* error);
+
+	// 从默认值开始重新读取配置文件并应用命令行覆盖，失败时内容不确定
+	bool load(std::string* error);
+
+	// 与 other 相比有变化但不能重新加载的配置项，以逗号分隔
+	std::string diff_static(const server_config& other) const;
+
+	static const char* usage();
+
+private:
+	enum OPTION_TYPE { OPT_NUMBER = 0, OPT_BOOL, OPT_STRING };
+
+	// 配置项描述，value 指向本对象的成员
+	struct option {
+		const char* name;
+		OPTION_TYPE type;
+		void* value;
+		long min;
+		long max;
+		bool reloadable;
+	};
+
+	std::vector<option> options() const;
+	void reset();
+	bool set(const std::string& name, const std::string& value,
+	         std::string* error);
+
+private:
+	std::string m_path; // 配置文件路径，为空时不读取
+	std::vector<std::pair<std::string, std::string>> m_overrides; // 命令行覆盖
+};
+
+#endif
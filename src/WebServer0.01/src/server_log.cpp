@@ -0,0 +1,44 @@
+#include "server_log.h"
+
+#include <strings.h>
+
+std::atomic<uint32_t> server_log::m_sample_rate(1);
+tscns::TSCNS server_log::m_tsc;
+
+void server_log::init(const char* file, fmtlog::LogLevel level) {
+	m_tsc.init();
+
+	if (file)
+		fmtlog::setLogFile(file, false);
+	else
+		fmtlog::setLogFile(stdout, false);
+
+	fmtlog::setHeaderPattern("{YmdHMSe} {l}[{t}] {s} ");
+	fmtlog::flushOn(fmtlog::WRN);
+	fmtlog::setLogLevel(level);
+	fmtlog::startPollingThread(POLL_INTERVAL_NS);
+}
+
+void server_log::shutdown() {
+	fmtlog::stopPollingThread();
+	fmtlog::poll(true);
+}
+
+bool server_log::parse_level(const char* name, fmtlog::LogLevel* level) {
+	static const struct {
+		const char* name;
+		fmtlog::LogLevel level;
+	} levels[] = {
+	    {"debug", fmtlog::DBG}, {"info", fmtlog::INF}, {"warn", fmtlog::WRN},
+	    {"error", fmtlog::ERR}, {"off", fmtlog::OFF},
+	};
+
+	for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+		if (strcasecmp(name, levels[i].name) == 0) {
+			*level = levels[i].level;
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,72 @@
+#ifndef SERVERLOG_H
+#define SERVERLOG_H
+
+#include "../../base/others/TscTime/tscTime.h"
+#include "fmtlog.h"
+
+#include <atomic>
+#include <stdint.h>
+
+// 异步日志
+// 基于 fmtlog，日志语句只把参数写入当前线程的 SPSC 队列，不加锁也不格式化
+// 格式化与写文件由后台轮询线程完成，队列满时丢弃日志而不阻塞请求处理
+// 日志级别与采样率可在运行期由任意线程修改
+class server_log {
+public:
+	static const int64_t POLL_INTERVAL_NS = 1000000; // 轮询线程间隔
+
+public:
+	// file 为 NULL 时输出到 stdout，并启动轮询线程
+	static void init(const char* file, fmtlog::LogLevel level);
+
+	// 停止轮询线程并写出剩余日志
+	static void shutdown();
+
+	static void set_level(fmtlog::LogLevel level) { fmtlog::setLogLevel(level); }
+	static fmtlog::LogLevel get_level() { return fmtlog::getLogLevel(); }
+
+	// 按名称解析日志级别：debug、info、warn、error、off
+	static bool parse_level(const char* name, fmtlog::LogLevel* level);
+
+	// 采样日志每 n 条记录 1 条，为 1 时全部记录，为 0 时全部丢弃
+	static void set_sample_rate(uint32_t n) {
+		m_sample_rate.store(n, std::memory_order_relaxed);
+	}
+	static uint32_t get_sample_rate() {
+		return m_sample_rate.load(std::memory_order_relaxed);
+	}
+
+	// 本条采样日志是否记录，计数器为线程本地，不产生跨线程写
+	static bool sample() {
+		uint32_t n = m_sample_rate.load(std::memory_order_relaxed);
+		if (n <= 1)
+			return n == 1;
+
+		static thread_local uint32_t counter = 0;
+		return ++counter % n == 0;
+	}
+
+	// 访问日志计时使用的 TSC 时钟，init 时校准一次
+	// 只用于计算同一请求内各阶段的时间差，无需定期重新校准
+	static int64_t rdtsc() { return tscns::TSCNS::rdtsc(); }
+	static int64_t tsc_to_ns(int64_t ticks) {
+		return (int64_t)(ticks * m_tsc.ns_per_tsc_);
+	}
+
+private:
+	static std::atomic<uint32_t> m_sample_rate;
+	static tscns::TSCNS m_tsc;
+};
+
+// 按采样率记录的日志，用于请求路径上逐请求、逐行的日志
+// 先检查级别，级别关闭时不触及采样计数器
+#define FMTLOG_SAMPLED(level, format, ...)                                    \
+	do {                                                                      \
+		if (fmtlog::checkLogLevel(level) && server_log::sample())             \
+			FMTLOG(level, format, ##__VA_ARGS__);                             \
+	} while (0)
+
+#define logds(format, ...) FMTLOG_SAMPLED(fmtlog::DBG, format, ##__VA_ARGS__)
+#define logis(format, ...) FMTLOG_SAMPLED(fmtlog::INF, format, ##__VA_ARGS__)
+
+#endif
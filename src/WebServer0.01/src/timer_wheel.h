@@ -0,0 +1,181 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+#include <time.h>
+
+class timer_wheel;
+
+// 定时器节点，侵入式嵌入在被管理的对象中
+// prev/next 构成所在槽位的双向循环链表，未挂入时轮为 NULL
+struct timer_node {
+	timer_node* prev;
+	timer_node* next;
+	uint64_t expire;    // 到期 tick
+	void* data;         // 所属对象
+	timer_wheel* wheel; // 所在时间轮
+};
+
+// 分层时间轮
+// 共 LEVELS 层，每层 SLOTS 个槽位，第 n 层每个槽位跨度为 SLOTS^n 个 tick
+// 定时器按剩余时间落入对应层，低层转完一圈时将上一层的一个槽位下放到低层
+// 添加、取消、刷新均为 O(1)，每个 tick 只处理到期槽位
+// 非线程安全，只能由所属事件循环线程访问
+class timer_wheel {
+public:
+	static const int SLOT_BITS = 6;
+	static const int SLOTS = 1 << SLOT_BITS;
+	static const int LEVELS = 4;
+
+public:
+	explicit timer_wheel(int tick_ms = 100) : m_tick_ms(tick_ms), m_count(0) {
+		m_current = now_tick();
+		for (int l = 0; l < LEVELS; l++) {
+			for (int s = 0; s < SLOTS; s++) {
+				m_slots[l][s].prev = &m_slots[l][s];
+				m_slots[l][s].next = &m_slots[l][s];
+			}
+		}
+	}
+
+	timer_wheel(const timer_wheel&) = delete;
+	timer_wheel& operator=(const timer_wheel&) = delete;
+
+	static void init_node(timer_node* node, void* data) {
+		node->prev = node->next = NULL;
+		node->expire = 0;
+		node->data = data;
+		node->wheel = NULL;
+	}
+
+	// 添加或刷新定时器，timeout_ms 后到期
+	void add(timer_node* node, int timeout_ms) {
+		cancel(node);
+
+		// 时间轮为空时 advance 不再推进，先同步到当前 tick
+		if (m_count == 0)
+			m_current = now_tick();
+
+		uint64_t ticks = (timeout_ms + m_tick_ms - 1) / m_tick_ms;
+		node->expire = m_current + (ticks ? ticks : 1);
+		node->wheel = this;
+		link(node);
+		m_count++;
+	}
+
+	// 取消定时器，未挂入时为空操作
+	static void cancel(timer_node* node) {
+		if (!node->wheel)
+			return;
+
+		node->prev->next = node->next;
+		node->next->prev = node->prev;
+		node->prev = node->next = NULL;
+		node->wheel->m_count--;
+		node->wheel = NULL;
+	}
+
+	bool empty() const { return m_count == 0; }
+	int tick_ms() const { return m_tick_ms; }
+
+	// 推进到当前时间，对每个到期定时器调用 cb
+	// 到期节点先从时间轮中取出，回调中可以重新 add
+	template <typename F>
+	void advance(F cb) {
+		uint64_t target = now_tick();
+
+		// 时间轮为空时直接跳到当前 tick
+		if (m_count == 0) {
+			m_current = target;
+			return;
+		}
+
+		while (m_current < target) {
+			m_current++;
+
+			// 低层转完一圈，逐层下放上一层的槽位
+			uint64_t t = m_current;
+			for (int l = 1; l < LEVELS && (t & (SLOTS - 1)) == 0; l++) {
+				t >>= SLOT_BITS;
+				cascade(&m_slots[l][t & (SLOTS - 1)]);
+			}
+
+			timer_node expired;
+			take(&m_slots[0][m_current & (SLOTS - 1)], &expired);
+
+			while (expired.next != &expired) {
+				timer_node* node = expired.next;
+				node->prev->next = node->next;
+				node->next->prev = node->prev;
+				node->prev = node->next = NULL;
+				node->wheel = NULL;
+				m_count--;
+				cb(node);
+			}
+		}
+	}
+
+private:
+	uint64_t now_tick() const {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+		return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / m_tick_ms;
+	}
+
+	// 按剩余 tick 数选择层与槽位，超出范围的放入最高层
+	void link(timer_node* node) {
+		uint64_t delta = node->expire - m_current;
+		int level = 0;
+		while (level < LEVELS - 1 &&
+		       delta >= ((uint64_t)1 << (SLOT_BITS * (level + 1))))
+			level++;
+
+		uint64_t expire = node->expire;
+		uint64_t max_delta = ((uint64_t)1 << (SLOT_BITS * LEVELS)) - 1;
+		if (delta > max_delta)
+			expire = m_current + max_delta;
+
+		timer_node* head =
+		    &m_slots[level][(expire >> (SLOT_BITS * level)) & (SLOTS - 1)];
+		node->next = head;
+		node->prev = head->prev;
+		head->prev->next = node;
+		head->prev = node;
+	}
+
+	// 将槽位中的全部节点移入 list
+	static void take(timer_node* slot, timer_node* list) {
+		if (slot->next == slot) {
+			list->prev = list->next = list;
+			return;
+		}
+
+		list->next = slot->next;
+		list->prev = slot->prev;
+		list->next->prev = list;
+		list->prev->next = list;
+		slot->prev = slot->next = slot;
+	}
+
+	// 将上层槽位中的节点按剩余时间重新挂入
+	void cascade(timer_node* slot) {
+		timer_node list;
+		take(slot, &list);
+
+		while (list.next != &list) {
+			timer_node* node = list.next;
+			node->prev->next = node->next;
+			node->next->prev = node->prev;
+			link(node);
+		}
+	}
+
+private:
+	int m_tick_ms;
+	uint64_t m_current; // 当前 tick
+	int m_count;        // 挂入的定时器数量
+
+	timer_node m_slots[LEVELS][SLOTS];
+};
+
+#endif
@@ -0,0 +1,615 @@
+#include "uring_backend.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+uring_backend::uring_backend(unsigned entries)
+    : m_ring_fd(-1), m_enter_fd(-1), m_enter_flags(0), m_sq_ptr(MAP_FAILED),
+      m_cq_ptr(MAP_FAILED), m_sqes((io_uring_sqe*)MAP_FAILED), m_pending(0),
+      m_has_owner(false), m_accept_fd(-1), m_accept_data(0),
+      m_streaming(false), m_file_slots(0), m_buf_ring(NULL), m_bufs(NULL),
+      m_buf_tail(0) {
+	if (!setup(entries)) {
+		if (m_ring_fd != -1) {
+			close(m_ring_fd);
+			m_ring_fd = -1;
+		}
+		return;
+	}
+
+	m_streaming = setup_stream();
+}
+
+uring_backend::~uring_backend() {
+	if (m_bufs)
+		munmap(m_bufs, (size_t)RECV_BUF_COUNT * RECV_BUF_SIZE);
+	if (m_buf_ring)
+		munmap(m_buf_ring, RECV_BUF_COUNT * sizeof(io_uring_buf));
+	if (m_sqes != MAP_FAILED)
+		munmap(m_sqes, m_sqes_size);
+	if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr)
+		munmap(m_cq_ptr, m_cq_size);
+	if (m_sq_ptr != MAP_FAILED)
+		munmap(m_sq_ptr, m_sq_size);
+	if (m_ring_fd != -1)
+		close(m_ring_fd);
+}
+
+bool uring_backend::setup(unsigned entries) {
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	m_ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (m_ring_fd < 0) {
+		m_ring_fd = -1;
+		return false;
+	}
+
+	// 带超时的等待依赖 IORING_ENTER_EXT_ARG
+	if (!(p.features & IORING_FEAT_EXT_ARG))
+		return false;
+
+	m_enter_fd = m_ring_fd;
+	m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+	// 新内核上 SQ 与 CQ 共用一次映射
+	bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap) {
+		if (m_cq_size > m_sq_size)
+			m_sq_size = m_cq_size;
+		m_cq_size = m_sq_size;
+	}
+
+	m_sq_ptr = mmap(0, m_sq_size, PROT_READ | PROT_WRITE,
+	                MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+	if (m_sq_ptr == MAP_FAILED)
+		return false;
+
+	if (single_mmap)
+		m_cq_ptr = m_sq_ptr;
+	else {
+		m_cq_ptr = mmap(0, m_cq_size, PROT_READ | PROT_WRITE,
+		                MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING);
+		if (m_cq_ptr == MAP_FAILED)
+			return false;
+	}
+
+	m_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+	m_sqes = (io_uring_sqe*)mmap(0, m_sqes_size, PROT_READ | PROT_WRITE,
+	                             MAP_SHARED | MAP_POPULATE, m_ring_fd,
+	                             IORING_OFF_SQES);
+	if (m_sqes == MAP_FAILED)
+		return false;
+
+	char* sq = (char*)m_sq_ptr;
+	m_sq_head = (unsigned*)(sq + p.sq_off.head);
+	m_sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	m_sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	m_sq_array = (unsigned*)(sq + p.sq_off.array);
+	m_sq_entries = p.sq_entries;
+
+	char* cq = (char*)m_cq_ptr;
+	m_cq_head = (unsigned*)(cq + p.cq_off.head);
+	m_cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	m_cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	m_cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	return true;
+}
+
+// 注册稀疏的固定文件表与接收缓冲区环，任一失败时连接退回就绪通知
+// 固定文件表以 fd 为下标，大小取 RLIMIT_NOFILE，不超过 MAX_FILE_SLOTS
+bool uring_backend::setup_stream() {
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) < 0)
+		return false;
+	m_file_slots = limit.rlim_cur < MAX_FILE_SLOTS ? limit.rlim_cur : MAX_FILE_SLOTS;
+
+	io_uring_rsrc_register files;
+	memset(&files, 0, sizeof(files));
+	files.nr = m_file_slots;
+	files.flags = IORING_RSRC_REGISTER_SPARSE;
+	if (syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_FILES2,
+	            &files, sizeof(files)) < 0)
+		return false;
+
+	void* ring = mmap(NULL, RECV_BUF_COUNT * sizeof(io_uring_buf),
+	                  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED)
+		return false;
+	m_buf_ring = (io_uring_buf_ring*)ring;
+
+	void* bufs = mmap(NULL, (size_t)RECV_BUF_COUNT * RECV_BUF_SIZE,
+	                  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bufs == MAP_FAILED)
+		return false;
+	m_bufs = (char*)bufs;
+
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring;
+	reg.ring_entries = RECV_BUF_COUNT;
+	reg.bgid = RECV_BUF_GROUP;
+	if (syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_PBUF_RING,
+	            &reg, 1) < 0)
+		return false;
+
+	for (unsigned i = 0; i < RECV_BUF_COUNT; i++)
+		provide(i);
+
+	m_update_fds.resize(m_sq_entries);
+	return true;
+}
+
+int uring_backend::enter(unsigned to_submit, unsigned min_complete,
+                         unsigned flags, const void* arg, size_t argsz) {
+	// 注册的 ring fd 仅对注册它的 reactor 线程有效
+	int fd = m_ring_fd;
+	if (m_enter_fd != m_ring_fd && m_has_owner &&
+	    pthread_equal(m_owner, pthread_self())) {
+		fd = m_enter_fd;
+		flags |= m_enter_flags;
+	}
+
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg,
+	               argsz);
+}
+
+uint32_t& uring_backend::gen(int fd) {
+	if ((size_t)fd >= m_gen.size()) {
+		m_gen.resize(fd + 1024, 0);
+		m_poll_ev.resize(fd + 1024, 0);
+		m_data.resize(fd + 1024, 0);
+		m_stream.resize(fd + 1024, false);
+	}
+
+	return m_gen[fd];
+}
+
+// 保证 SQ 中至少有 count 个空闲位置，不足时先提交已填写的请求，调用者需持有 m_mutex
+// 链接的请求需一次取得，否则链头可能先被单独提交
+bool uring_backend::reserve(unsigned count) {
+	unsigned tail = *m_sq_tail;
+	if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) + count <= m_sq_entries)
+		return true;
+
+	enter(m_pending, 0, 0, NULL, 0);
+	m_pending = 0;
+	return tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) + count <=
+	       m_sq_entries;
+}
+
+// 获取空闲 SQE，调用者需持有 m_mutex，填写完毕后需推进 SQ 尾指针
+io_uring_sqe* uring_backend::get_sqe() {
+	if (!reserve(1))
+		return NULL;
+
+	unsigned index = *m_sq_tail & *m_sq_mask;
+	io_uring_sqe* sqe = &m_sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	m_sq_array[index] = index;
+	return sqe;
+}
+
+static inline void push_sqe(unsigned* tail) {
+	__atomic_store_n(tail, *tail + 1, __ATOMIC_RELEASE);
+}
+
+void uring_backend::prep_poll(int fd, uint32_t events) {
+	io_uring_sqe* sqe = get_sqe();
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events & ~(EPOLLET | EPOLLONESHOT);
+	sqe->len = (events & EPOLLONESHOT) ? 0 : IORING_POLL_ADD_MULTI;
+	sqe->user_data = make_data(OP_POLL, gen(fd), fd);
+
+	push_sqe(m_sq_tail);
+	m_pending++;
+}
+
+void uring_backend::prep_accept(int fd) {
+	io_uring_sqe* sqe = get_sqe();
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = make_data(OP_ACCEPT, gen(fd), fd);
+
+	push_sqe(m_sq_tail);
+	m_pending++;
+}
+
+// 接收到的数据写入内核从缓冲区环中选出的缓冲区，其编号随完成事件返回
+void uring_backend::prep_recv(int fd) {
+	io_uring_sqe* sqe = get_sqe();
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RECV_BUF_GROUP;
+	sqe->user_data = make_data(OP_RECV, gen(fd), fd);
+
+	push_sqe(m_sq_tail);
+	m_pending++;
+}
+
+void uring_backend::prep_cancel(OP_TYPE type, uint32_t gen, int fd) {
+	io_uring_sqe* sqe = get_sqe();
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = make_data(type, gen, fd);
+	sqe->user_data = make_data(OP_CANCEL, 0, fd);
+
+	push_sqe(m_sq_tail);
+	m_pending++;
+}
+
+// 将固定文件表的 fd 号槽位设为 value，为 -1 时移除
+// 参数按 SQE 下标存放，SQE 被内核取走前不会被覆盖
+bool uring_backend::prep_files_update(int fd, int value, unsigned flags) {
+	io_uring_sqe* sqe = get_sqe();
+	if (!sqe)
+		return false;
+
+	int* arg = &m_update_fds[sqe - m_sqes];
+	*arg = value;
+
+	sqe->opcode = IORING_OP_FILES_UPDATE;
+	sqe->fd = -1;
+	sqe->flags = flags;
+	sqe->addr = (uint64_t)(uintptr_t)arg;
+	sqe->len = 1;
+	sqe->off = fd;
+	sqe->user_data = make_data(OP_FILES, gen(fd), fd);
+
+	push_sqe(m_sq_tail);
+	m_pending++;
+	return true;
+}
+
+// 将缓冲区放回缓冲区环，只由 reactor 线程调用
+void uring_backend::provide(unsigned bid) {
+	// C++ 下头文件中的柔性数组 bufs 偏移为 8，直接按 io_uring_buf 数组访问
+	io_uring_buf* buf =
+	    (io_uring_buf*)m_buf_ring + (m_buf_tail & (RECV_BUF_COUNT - 1));
+	buf->addr = (uint64_t)(uintptr_t)(m_bufs + (size_t)bid * RECV_BUF_SIZE);
+	buf->len = RECV_BUF_SIZE;
+	buf->bid = bid;
+
+	m_buf_tail++;
+	__atomic_store_n(&m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE);
+}
+
+// 非 reactor 线程调用时立即提交，reactor 线程则留到 wait 中一起提交
+void uring_backend::flush() {
+	unsigned to_submit = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_has_owner && pthread_equal(m_owner, pthread_self()))
+			return;
+
+		to_submit = m_pending;
+		m_pending = 0;
+	}
+
+	if (to_submit)
+		enter(to_submit, 0, 0, NULL, 0);
+}
+
+bool uring_backend::add(int fd, uint32_t events, uint64_t data) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		gen(fd);
+		m_data[fd] = data;
+		m_poll_ev[fd] = (events & EPOLLONESHOT) ? 0 : events;
+		prep_poll(fd, events);
+	}
+
+	flush();
+	return true;
+}
+
+bool uring_backend::mod(int fd, uint32_t events, uint64_t data) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		uint32_t& g = gen(fd);
+		m_data[fd] = data;
+
+		// 完成模式的连接等待可读时提交一次接收，等待可写时仍使用单次轮询
+		if (m_stream[fd]) {
+			if (events & EPOLLIN)
+				prep_recv(fd);
+			else
+				prep_poll(fd, events | EPOLLONESHOT);
+		} else {
+			// 常驻的 multishot 轮询需先取消
+			if (m_poll_ev[fd]) {
+				prep_cancel(OP_POLL, g, fd);
+				g++;
+			}
+
+			m_poll_ev[fd] = (events & EPOLLONESHOT) ? 0 : events;
+			prep_poll(fd, events);
+		}
+	}
+
+	flush();
+	return true;
+}
+
+bool uring_backend::del(int fd) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		uint32_t& g = gen(fd);
+
+		// 取消仍在等待的轮询，否则其持有的文件引用会使 socket 无法真正关闭
+		// 监听 socket 暂停接受连接时同样经由 del 取消，此时还需取消 multishot accept
+		prep_cancel(OP_POLL, g, fd);
+		if (fd == m_accept_fd)
+			prep_cancel(OP_ACCEPT, g, fd);
+
+		// 完成模式的连接还需取消接收，并从固定文件表中移除，否则 close 后 socket 仍被引用
+		if (m_stream[fd]) {
+			prep_cancel(OP_RECV, g, fd);
+			prep_cancel(OP_SEND, g, fd);
+			prep_files_update(fd, -1, IOSQE_CQE_SKIP_SUCCESS);
+			m_stream[fd] = false;
+		}
+
+		// 之后到达的旧完成事件按代数丢弃
+		g++;
+		m_poll_ev[fd] = 0;
+	}
+
+	flush();
+	return true;
+}
+
+bool uring_backend::add_acceptor(int listenfd, uint64_t data) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		gen(listenfd);
+		m_data[listenfd] = data;
+		m_accept_fd = listenfd;
+		m_accept_data = data;
+		prep_accept(listenfd);
+	}
+
+	flush();
+	return true;
+}
+
+// 登记固定文件与第一次接收链接在一起，登记失败时接收随之取消
+bool uring_backend::add_stream(int fd, uint64_t data) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_streaming || fd < 0 || (unsigned)fd >= m_file_slots)
+			return false;
+
+		gen(fd);
+		if (!reserve(2))
+			return false;
+
+		m_data[fd] = data;
+		m_poll_ev[fd] = 0;
+		m_stream[fd] = true;
+		prep_files_update(fd, fd, IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS);
+		prep_recv(fd);
+	}
+
+	flush();
+	return true;
+}
+
+// MSG_WAITALL 使内核在 socket 可写后继续发送，直到全部发出或出错
+// 未全部发出时链接的接收以 -ECANCELED 结束，由调用者重新提交剩余部分
+bool uring_backend::send(int fd, const msghdr* msg, bool recv_after) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (fd < 0 || (size_t)fd >= m_stream.size() || !m_stream[fd] ||
+		    !reserve(recv_after ? 2 : 1))
+			return false;
+
+		io_uring_sqe* sqe = get_sqe();
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = fd;
+		sqe->flags = IOSQE_FIXED_FILE | (recv_after ? IOSQE_IO_LINK : 0);
+		sqe->addr = (uint64_t)(uintptr_t)msg;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+		sqe->user_data = make_data(OP_SEND, gen(fd), fd);
+		push_sqe(m_sq_tail);
+		m_pending++;
+
+		if (recv_after)
+			prep_recv(fd);
+	}
+
+	flush();
+	return true;
+}
+
+void uring_backend::cancel_send(int fd) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		prep_cancel(OP_SEND, gen(fd), fd);
+	}
+
+	flush();
+}
+
+void uring_backend::recycle(const io_event& event) {
+	provide(event.buf_id);
+}
+
+static inline void set_event(io_event* event, int type, uint32_t events,
+                             uint64_t data, int res) {
+	event->type = type;
+	event->events = events;
+	event->data = data;
+	event->res = res;
+}
+
+int uring_backend::wait(io_event* events, int max_events, int timeout) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	if (!m_has_owner) {
+		m_owner = pthread_self();
+		m_has_owner = true;
+
+#ifdef IORING_ENTER_REGISTERED_RING
+		// 注册 ring fd，省去每次 io_uring_enter 查找文件描述符的开销
+		io_uring_rsrc_update update;
+		memset(&update, 0, sizeof(update));
+		update.offset = -1U;
+		update.data = m_ring_fd;
+		if (syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_RING_FDS,
+		            &update, 1) == 1) {
+			m_enter_fd = update.offset;
+			m_enter_flags = IORING_ENTER_REGISTERED_RING;
+		}
+#endif
+	}
+
+	unsigned to_submit = m_pending;
+	m_pending = 0;
+
+	// 没有已完成事件时，提交与等待合并为一次系统调用
+	unsigned head = *m_cq_head;
+	if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE) && timeout != 0) {
+		lock.unlock();
+
+		__kernel_timespec ts;
+		io_uring_getevents_arg arg;
+		memset(&arg, 0, sizeof(arg));
+		if (timeout > 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000LL;
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+		}
+
+		int ret = enter(to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+		                &arg, sizeof(arg));
+		if (ret < 0 && errno != ETIME && errno != EINTR)
+			return -1;
+
+		lock.lock();
+	} else if (to_submit) {
+		enter(to_submit, 0, 0, NULL, 0);
+	}
+
+	int number = 0;
+	head = *m_cq_head;
+	unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail && number < max_events) {
+		io_uring_cqe* cqe = &m_cqes[head & *m_cq_mask];
+		uint64_t data = cqe->user_data;
+		int res = cqe->res;
+		bool more = cqe->flags & IORING_CQE_F_MORE;
+		bool has_buf = cqe->flags & IORING_CQE_F_BUFFER;
+		unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		head++;
+
+		OP_TYPE type = (OP_TYPE)(data >> 56);
+		int fd = (int)(uint32_t)data;
+
+		if (type == OP_CANCEL)
+			continue;
+
+		bool stale = ((gen(fd) ^ (uint32_t)(data >> 32)) & 0xffffff) != 0;
+
+		if (type == OP_ACCEPT) {
+			// 取消生效前内核已接受的连接不能丢弃，否则描述符泄漏、客户端被挂起
+			// 监听 socket 此时可能已关闭，其 fd 被复用，因此不查 m_data
+			if (stale) {
+				if (res >= 0)
+					set_event(&events[number++], IO_READY, EPOLLIN,
+					          m_accept_data, res);
+				continue;
+			}
+
+			if (!more) {
+				// 内核不支持 multishot accept 时退回监听 socket 轮询
+				if (res == -EINVAL) {
+					m_poll_ev[fd] = EPOLLIN;
+					prep_poll(fd, EPOLLIN);
+				} else
+					prep_accept(fd);
+			}
+
+			if (res < 0)
+				continue;
+
+			set_event(&events[number++], IO_READY, EPOLLIN, m_data[fd], res);
+		} else if (type == OP_RECV) {
+			// 被取消或已过期的接收也可能取得了缓冲区，需放回
+			if (stale || res == -ECANCELED) {
+				if (has_buf)
+					provide(bid);
+				continue;
+			}
+
+			// 缓冲区暂时用尽，reactor 处理完本轮事件即会归还，重新提交接收
+			if (res == -ENOBUFS) {
+				prep_recv(fd);
+				continue;
+			}
+
+			if (res <= 0) {
+				if (has_buf)
+					provide(bid);
+				set_event(&events[number++], IO_READY,
+				          res == 0 ? EPOLLRDHUP : EPOLLERR, m_data[fd], res);
+				continue;
+			}
+
+			io_event* event = &events[number++];
+			set_event(event, IO_RECV, 0, m_data[fd], res);
+			event->buf = m_bufs + (size_t)bid * RECV_BUF_SIZE;
+			event->buf_id = bid;
+		} else if (type == OP_SEND) {
+			if (stale)
+				continue;
+
+			set_event(&events[number++], IO_SEND, 0, m_data[fd], res);
+		} else if (type == OP_FILES) {
+			// 登记固定文件失败，链接的接收已被取消，以出错通知连接
+			if (stale || res >= 0)
+				continue;
+
+			set_event(&events[number++], IO_READY, EPOLLERR, m_data[fd], res);
+		} else {
+			// fd 已被 del，丢弃旧请求的完成事件
+			if (stale || res == -ECANCELED)
+				continue;
+
+			// multishot 轮询被内核终止时重新提交
+			if (m_poll_ev[fd] && !more)
+				prep_poll(fd, m_poll_ev[fd]);
+
+			set_event(&events[number++], IO_READY,
+			          (res < 0) ? EPOLLERR : (uint32_t)res, m_data[fd], -1);
+		}
+	}
+
+	__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+	return number;
+}
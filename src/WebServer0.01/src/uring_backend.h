@@ -0,0 +1,114 @@
+#ifndef URINGBACKEND_H
+#define URINGBACKEND_H
+
+#include "io_backend.h"
+
+#include <atomic>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <pthread.h>
+#include <vector>
+
+// io_uring 后端
+// 以 IORING_OP_POLL_ADD 实现与 epoll 相同的就绪通知语义，EPOLLONESHOT 对应单次轮询，
+// 否则使用 multishot 轮询；监听 socket 使用 multishot accept，由内核直接完成 accept
+// 连接 socket 以完成模式收发：fd 本身作为下标登记在稀疏的固定文件表中，
+// 接收使用 IOSQE_BUFFER_SELECT 从提供的缓冲区环中取缓冲区，连接空闲时不占用内存；
+// 发送使用 SENDMSG 并以 IOSQE_IO_LINK 链接下一次接收，一个请求只需一次 io_uring_enter
+// 内核不支持缓冲区环或固定文件时 add_stream 返回 false，连接退回就绪通知
+// reactor 线程内的请求只填写 SQE，在下一次 wait 时与等待合并为一次 io_uring_enter
+// 工作线程调用时立即提交，以免 reactor 阻塞在 wait 中而看不到新的请求
+// user_data 由请求类型、fd 和 fd 的代数组成，fd 关闭后旧请求的完成事件按代数丢弃
+class uring_backend : public io_backend {
+public:
+	uring_backend(unsigned entries = 4096);
+	~uring_backend();
+
+	bool add(int fd, uint32_t events, uint64_t data);
+	bool mod(int fd, uint32_t events, uint64_t data);
+	bool del(int fd);
+	bool add_acceptor(int listenfd, uint64_t data);
+	bool add_stream(int fd, uint64_t data);
+	bool send(int fd, const msghdr* msg, bool recv_after);
+	void cancel_send(int fd);
+	void recycle(const io_event& event);
+	int wait(io_event* events, int max_events, int timeout);
+	const char* name() const { return "io_uring"; }
+
+	bool valid() const { return m_ring_fd != -1; }
+
+private:
+	// 请求类型
+	enum OP_TYPE { OP_POLL = 1, OP_ACCEPT, OP_CANCEL, OP_RECV, OP_SEND, OP_FILES };
+
+	static const unsigned RECV_BUF_COUNT = 256;   // 缓冲区环大小，需为 2 的幂
+	static const unsigned RECV_BUF_SIZE = 16384;  // 每个接收缓冲区的大小
+	static const unsigned RECV_BUF_GROUP = 0;     // 缓冲区组编号
+	static const unsigned MAX_FILE_SLOTS = 65536; // 固定文件表大小的上限
+
+	static uint64_t make_data(OP_TYPE type, uint32_t gen, int fd) {
+		return ((uint64_t)type << 56) | ((uint64_t)(gen & 0xffffff) << 32) |
+		       (uint32_t)fd;
+	}
+
+	bool setup(unsigned entries);
+	bool setup_stream();
+	bool reserve(unsigned count);
+	io_uring_sqe* get_sqe();
+	void prep_poll(int fd, uint32_t events);
+	void prep_accept(int fd);
+	void prep_recv(int fd);
+	void prep_cancel(OP_TYPE type, uint32_t gen, int fd);
+	bool prep_files_update(int fd, int value, unsigned flags);
+	void provide(unsigned bid);
+	void flush();
+	int enter(unsigned to_submit, unsigned min_complete, unsigned flags,
+	          const void* arg, size_t argsz);
+	uint32_t& gen(int fd);
+
+private:
+	int m_ring_fd;  // io_uring 实例
+	int m_enter_fd; // io_uring_enter 使用的 fd，注册成功后为注册索引
+	unsigned m_enter_flags;
+
+	// SQ 与 CQ 环形队列
+	void* m_sq_ptr;
+	void* m_cq_ptr;
+	size_t m_sq_size;
+	size_t m_cq_size;
+	io_uring_sqe* m_sqes;
+	size_t m_sqes_size;
+
+	unsigned* m_sq_head;
+	unsigned* m_sq_tail;
+	unsigned* m_sq_mask;
+	unsigned* m_sq_array;
+	unsigned m_sq_entries;
+
+	unsigned* m_cq_head;
+	unsigned* m_cq_tail;
+	unsigned* m_cq_mask;
+	io_uring_cqe* m_cqes;
+
+	std::mutex m_mutex;     // 保护 SQ 与代数表
+	unsigned m_pending;     // 已填写尚未提交的 SQE 数量
+	pthread_t m_owner;      // 调用 wait 的 reactor 线程
+	std::atomic<bool> m_has_owner;
+	int m_accept_fd;        // 由 multishot accept 接受连接的监听 socket
+	uint64_t m_accept_data; // 监听 socket 注册时传入的数据
+
+	std::vector<uint32_t> m_gen;      // 每个 fd 的代数
+	std::vector<uint32_t> m_poll_ev;  // 非 ONESHOT 轮询的事件，用于重新提交
+	std::vector<uint64_t> m_data;     // 注册时传入的数据，随事件返回
+	std::vector<bool> m_stream;       // fd 以完成模式收发
+
+	// 完成模式，固定文件表与缓冲区环均注册成功时可用
+	bool m_streaming;
+	unsigned m_file_slots;          // 固定文件表大小，不小于该值的 fd 退回就绪通知
+	std::vector<int> m_update_fds;  // IORING_OP_FILES_UPDATE 的参数，按 SQE 下标存放
+	io_uring_buf_ring* m_buf_ring;  // 缓冲区环，只由 reactor 线程补充
+	char* m_bufs;                   // RECV_BUF_COUNT 个接收缓冲区
+	uint16_t m_buf_tail;
+};
+
+#endif
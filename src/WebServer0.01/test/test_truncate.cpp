@@ -0,0 +1,276 @@
+// 发送中的文件被截断
+// 启动 ./out，以很小的接收缓冲区慢速下载一个大文件，下载途中将文件截断为 0
+// 服务器应关闭该连接，而不是让 sendfile 反复返回 0 占满 reactor 线程，
+// 之后仍能正常应答新的请求
+// 用法：test_truncate [服务器程序]，默认为 ./out
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static int main_ret = 0;
+static int test_count = 0;
+static int test_pass = 0;
+
+#define EXPECT_TRUE(actual, what)                                             \
+	do {                                                                      \
+		test_count++;                                                         \
+		if (actual)                                                           \
+			test_pass++;                                                      \
+		else {                                                                \
+			fprintf(stderr, "%s:%d: %s: %s\n", __FILE__, __LINE__, g_mode,    \
+			        what);                                                    \
+			main_ret = 1;                                                     \
+		}                                                                     \
+	} while (0)
+
+static const size_t BIG_FILE_SIZE = 64 * 1024 * 1024;
+
+static std::string g_root; // 临时的网站根目录
+static char g_mode[64];     // 当前测试的后端与处理模式
+
+static bool write_file(const std::string& path, size_t size) {
+	FILE* fp = fopen(path.c_str(), "wb");
+	if (!fp)
+		return false;
+
+	char buf[65536];
+	memset(buf, 'x', sizeof(buf));
+	for (size_t left = size; left > 0;) {
+		size_t n = left < sizeof(buf) ? left : sizeof(buf);
+		if (fwrite(buf, 1, n, fp) != n) {
+			fclose(fp);
+			return false;
+		}
+		left -= n;
+	}
+
+	return fclose(fp) == 0;
+}
+
+// 由内核分配一个空闲端口
+static int free_port() {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	socklen_t len = sizeof(addr);
+	bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+	getsockname(fd, (struct sockaddr*)&addr, &len);
+	close(fd);
+	return ntohs(addr.sin_port);
+}
+
+// rcvbuf 不为 0 时在连接前设置接收缓冲区，使服务器的发送停在文件中间
+static int connect_to(int port, int rcvbuf) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (rcvbuf > 0)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	struct timeval tv = {5, 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static pid_t start_server(const char* server, int port, const char* reactors,
+                          const char* inline_mode, const char* backend) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		std::string port_arg = std::to_string(port);
+		std::string root_arg = "--doc_root=" + g_root;
+
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDOUT_FILENO);
+		dup2(null_fd, STDERR_FILENO);
+
+		execl(server, server, "127.0.0.1", port_arg.c_str(), reactors,
+		      inline_mode, backend, root_arg.c_str(), "--log.level=error",
+		      (char*)NULL);
+		_exit(127);
+	}
+
+	// 等待服务器开始监听
+	for (int i = 0; i < 100; i++) {
+		int fd = connect_to(port, 0);
+		if (fd >= 0) {
+			close(fd);
+			return pid;
+		}
+		usleep(20000);
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+static void stop_server(pid_t pid) {
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+// 进程已使用的 CPU 时间，单位为时钟滴答
+static long cpu_ticks(pid_t pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+
+	FILE* fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+
+	char buf[1024];
+	size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+	fclose(fp);
+	buf[n] = '\0';
+
+	// 进程名可含空格，从最后一个 ')' 之后数字段，utime 与 stime 为第 14、15 项
+	char* p = strrchr(buf, ')');
+	if (!p)
+		return -1;
+
+	long utime = 0, stime = 0;
+	if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %ld %ld",
+	           &utime, &stime) != 2)
+		return -1;
+	return utime + stime;
+}
+
+// 读到连接关闭或超时为止，返回读到的字节数，超时返回 -1
+static long read_until_close(int fd) {
+	char buf[65536];
+	long total = 0;
+
+	while (true) {
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if (n > 0) {
+			total += n;
+			continue;
+		}
+		if (n == 0 || errno == ECONNRESET)
+			return total;
+		if (errno == EINTR)
+			continue;
+		return -1;
+	}
+}
+
+static bool get_ok(int port, const char* path) {
+	int fd = connect_to(port, 0);
+	if (fd < 0)
+		return false;
+
+	std::string req = std::string("GET ") + path +
+	                  " HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n";
+	send(fd, req.data(), req.size(), 0);
+
+	char buf[64];
+	ssize_t n = recv(fd, buf, sizeof(buf) - 1, MSG_WAITALL);
+	close(fd);
+
+	if (n <= 0)
+		return false;
+	buf[n] = '\0';
+	return strncmp(buf, "HTTP/1.1 200", 12) == 0;
+}
+
+static void test_truncate(const char* server, const char* reactors,
+                          const char* inline_mode, const char* backend) {
+	snprintf(g_mode, sizeof(g_mode), "%s %s", backend,
+	         strcmp(inline_mode, "1") == 0 ? "inline" : "pool");
+
+	std::string big = g_root + "/big.bin";
+	if (!write_file(big, BIG_FILE_SIZE)) {
+		EXPECT_TRUE(false, "write big.bin");
+		return;
+	}
+
+	int port = free_port();
+	pid_t pid = start_server(server, port, reactors, inline_mode, backend);
+	EXPECT_TRUE(pid > 0, "server started");
+	if (pid <= 0)
+		return;
+
+	int fd = connect_to(port, 4096);
+	EXPECT_TRUE(fd >= 0, "connect");
+	if (fd < 0) {
+		stop_server(pid);
+		return;
+	}
+
+	const char req[] =
+	    "GET /big.bin HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n";
+	send(fd, req, sizeof(req) - 1, 0);
+
+	// 先读一部分，确认应答已开始发送
+	char buf[65536];
+	ssize_t n = recv(fd, buf, sizeof(buf), 0);
+	EXPECT_TRUE(n > 12 && strncmp(buf, "HTTP/1.1 200", 12) == 0,
+	            "response started");
+
+	// 截断后服务器缓存的 fd 与映射仍指向同一 inode，剩余内容已不存在
+	EXPECT_TRUE(truncate(big.c_str(), 0) == 0, "truncate");
+	usleep(100000);
+
+	long received = read_until_close(fd);
+	close(fd);
+	EXPECT_TRUE(received >= 0, "connection closed after truncation");
+	EXPECT_TRUE(received + n < (long)BIG_FILE_SIZE, "response cut short");
+
+	// reactor 线程没有空转
+	long before = cpu_ticks(pid);
+	sleep(1);
+	long after = cpu_ticks(pid);
+	EXPECT_TRUE(before >= 0 && after - before < sysconf(_SC_CLK_TCK) / 2,
+	            "server idle after truncation");
+
+	EXPECT_TRUE(write_file(g_root + "/small.txt", 100), "write small.txt");
+	EXPECT_TRUE(get_ok(port, "/small.txt"), "server still serving");
+
+	stop_server(pid);
+	unlink(big.c_str());
+	unlink((g_root + "/small.txt").c_str());
+}
+
+int main(int argc, char* argv[]) {
+	const char* server = argc > 1 ? argv[1] : "./out";
+
+	char root[] = "/tmp/webserver_test_XXXXXX";
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	g_root = root;
+
+	test_truncate(server, "1", "0", "epoll");
+	test_truncate(server, "1", "1", "epoll");
+	test_truncate(server, "1", "1", "uring");
+
+	rmdir(root);
+
+	printf("%d/%d (%3.2f%%) passed\n", test_pass, test_count,
+	       test_pass * 100.0 / test_count);
+	return main_ret;
+}
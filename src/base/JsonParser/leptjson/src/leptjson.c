@@ -668,7 +668,7 @@ static void* lept_context_pop(lept_context* c, size_t size) {
 
 static void lept_parse_whitespace(lept_context* c) {
 	const char* p = c->json;
-	while (*p == ' ' || *p == '\t' || *p == '\r')
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
 		p++;
 	c->json = p;
 }